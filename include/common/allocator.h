@@ -13,17 +13,69 @@
 #pragma once
 #include <atomic>
 #include <climits>
-#include <mutex>
+#include <cstdint>
 #include "common/defines.h"
 
+#if SCHOBI_ENABLE_ALLOCATOR_STATS
+	#define SCHOBI_ALLOCATOR_STATS_ADD(counter, amount) (counter).fetch_add(amount, std::memory_order_relaxed)
+	#define SCHOBI_ALLOCATOR_STATS_SUB(counter, amount) (counter).fetch_sub(amount, std::memory_order_relaxed)
+#else
+	#define SCHOBI_ALLOCATOR_STATS_ADD(counter, amount) (void)0
+	#define SCHOBI_ALLOCATOR_STATS_SUB(counter, amount) (void)0
+#endif
 
 namespace schobi
 {
 	template<typename, size_t>
 	struct ThreadsafeLinearAllocator;
 
+	//counters of one linear allocator label, all zero unless SCHOBI_ENABLE_ALLOCATOR_STATS is set
+	struct AllocatorStats
+	{
+		static constexpr uint32_t SizeHistogramBuckets = 16;
+
+		size_t live_allocations = 0;		//allocated and not freed yet, what is left at exit leaked
+		size_t live_bytes = 0;				//requested bytes of those, without alignment padding
+		size_t pages_in_use = 0;			//pages a thread allocates from or a live allocation keeps alive
+		size_t pages_cached = 0;			//idle pages of this page size, shared by all labels with the same page size
+		size_t tail_waste_bytes = 0;		//bytes left unused at the end of pages when the next allocation did not fit
+		size_t oversized_allocations = 0;	//allocations larger than a page
+		size_t size_histogram[SizeHistogramBuckets] = {};	//bucket i counts allocations up to 64 << i bytes, the last one everything larger
+	};
+
+	//idle pages beyond this many bytes per page size give their memory back to the os, defaults to 64 MB
+	void set_page_cache_limit(size_t bytes);
+	//frames larger than a page are rounded up to a quarter power of two and recycled, idle blocks beyond this many bytes give their memory back to the os, defaults to 64 MB
+	void set_oversized_cache_limit(size_t bytes);
+	//applies the batched frees of every allocator on the calling thread, idle threads call it so they do not pin pages
+	void flush_pending_frees();
+
 	namespace detail
 	{
+		//one per allocator and thread, linked on its first batched free
+		struct PendingFrees
+		{
+			void(*flush)() = nullptr;
+			PendingFrees* next = nullptr;
+		};
+		void register_pending_frees(PendingFrees* pending);
+
+		struct AllocatorCounters
+		{
+			std::atomic_size_t live_allocations = { 0 };
+			std::atomic_size_t live_bytes = { 0 };
+			std::atomic_size_t pages_in_use = { 0 };
+			std::atomic_size_t tail_waste_bytes = { 0 };
+			std::atomic_size_t oversized_allocations = { 0 };
+			std::atomic_size_t size_histogram[AllocatorStats::SizeHistogramBuckets] = {};
+
+			//reports what was never freed once the label goes away at exit
+			~AllocatorCounters();
+			void record_alloc(size_t size);
+			void record_free(size_t size);
+			AllocatorStats snapshot(size_t pages_cached) const;
+		};
+
 		struct AllocationImpl
 		{
 			static const size_t cacheline_size = 64;
@@ -35,7 +87,8 @@ namespace schobi
 				static const size_t refcount_max = ULLONG_MAX;
 				std::atomic_ullong refcount = { refcount_max };
 				size_t page_size;
-				Header* cache_link = nullptr;
+				std::atomic<Header*> cache_link = { nullptr };	//atomic because a stale reader may race with its reuse
+				bool trimmed = false;							//only the first small page is resident while cached
 
 
 				alignas(cacheline_size)	//padding to avoid false sharing
@@ -43,17 +96,60 @@ namespace schobi
 				size_t suballocation_offset = sizeof(Header);
 			};
 
+			//treiber stack linked through cache_link, the low bits of the aligned top carry a tag against aba.
+			//headers are never unmapped, so reading the link of one that got popped and reused meanwhile is safe and the tag fails the exchange
+			template<size_t alignment>
+			struct HeaderStack
+			{
+				static constexpr uintptr_t TagMask = alignment - 1;
+				std::atomic_uintptr_t top = { 0 };
+
+				void push(Header* head, Header* tail)
+				{
+					uintptr_t expected = top.load(std::memory_order_relaxed);
+					uintptr_t desired;
+					do
+					{
+						tail->cache_link.store(reinterpret_cast<Header*>(expected & ~TagMask), std::memory_order_relaxed);
+						desired = reinterpret_cast<uintptr_t>(head) | ((expected + 1) & TagMask);
+					} while (!top.compare_exchange_weak(expected, desired, std::memory_order_release, std::memory_order_relaxed));
+				}
+
+				Header* pop()
+				{
+					uintptr_t expected = top.load(std::memory_order_acquire);
+					while (Header* head = reinterpret_cast<Header*>(expected & ~TagMask))
+					{
+						Header* next = head->cache_link.load(std::memory_order_relaxed);
+						uintptr_t desired = reinterpret_cast<uintptr_t>(next) | ((expected + 1) & TagMask);
+						if (top.compare_exchange_weak(expected, desired, std::memory_order_acquire, std::memory_order_acquire))
+							return head;
+					}
+					return nullptr;
+				}
+			};
+
 			typedef Header* (*GetFromCacheType)();
-			AllocationImpl(size_t page_size, GetFromCacheType get_from_cache);
+			typedef void (*ReturnToCacheType)(Header*);
+			AllocationImpl(size_t page_size, GetFromCacheType get_from_cache, ReturnToCacheType return_to_cache, AllocatorCounters& counters);
 			~AllocationImpl();
 			SCHOBI_FORCEINLINE void* alloc(size_t offset, size_t size);
 			SCHOBI_FORCEINLINE Header* operator->() const;
 			void finalize();
 
+			//called when a page enters and leaves the cache, resident_bytes counts the cached pages that were not trimmed
+			static void trim(Header* header, std::atomic_size_t& resident_bytes);
+			static void untrim(Header* header, std::atomic_size_t& resident_bytes);
+
 		private:
+			static Header* map_page(size_t page_size);
+
 			GetFromCacheType get_from_cache;
+			ReturnToCacheType return_to_cache;
 
 			Header* header;
+			AllocatorCounters& counters;
+			friend struct ThreadsafeLinearAllocatorImpl;
 		};
 
 		struct ThreadsafeLinearAllocatorImpl
@@ -61,12 +157,16 @@ namespace schobi
 			using Header = AllocationImpl::Header;
 			static void* alloc(AllocationImpl& header, size_t size, size_t alignment);
 			static void free_header(Header* header, void(*return_to_cache)(Header*));
+
+		private:
+			static Header* alloc_oversized(size_t size, size_t alignment);
+			static void free_oversized(Header* header);
 		};
 
 		template<size_t page_size = 64 * 1024>
 		struct AllocationCache final : AllocationImpl
 		{
-			AllocationCache() : AllocationImpl(page_size, &get_from_cache)
+			AllocationCache(AllocatorCounters& counters) : AllocationImpl(page_size, &get_from_cache, &return_to_cache, counters)
 			{
 			}
 
@@ -74,34 +174,95 @@ namespace schobi
 			template<typename, size_t>
 			friend struct schobi::ThreadsafeLinearAllocator;
 
+			static constexpr uint32_t MagazineSize = 16;
+
+			//pages recycled by this thread, exchanged with the global stack in batches of half a magazine
+			struct Magazine
+			{
+				Header* pages[MagazineSize];
+				uint32_t count = 0;
+
+				~Magazine()
+				{
+					spill(count);
+					magazine_retired = true;
+				}
+
+				void spill(uint32_t spill_count)
+				{
+					if (spill_count == 0)
+						return;
+
+					Header* head = pages[count - spill_count];
+					for (uint32_t i = count - spill_count; i + 1 < count; i++)
+					{
+						pages[i]->cache_link.store(pages[i + 1], std::memory_order_relaxed);
+					}
+					global.push(head, pages[count - 1]);
+					count -= spill_count;
+				}
+			};
+
 			static Header* get_from_cache()
 			{
-				std::lock_guard<std::mutex> guard(cache_mutex);
-				if(cache_header != nullptr)
+				if (magazine_retired)
 				{
-					Header* ret = cache_header;
-					cache_header = ret->cache_link;
-					return ret;
+					Header* header = global.pop();
+					if (header != nullptr)
+					{
+						untrim(header, resident_bytes);
+						SCHOBI_ALLOCATOR_STATS_SUB(cached_pages, 1);
+					}
+					return header;
 				}
-				return nullptr;
+
+				Magazine& local = magazine;
+				if (local.count == 0)
+				{
+					while (local.count < MagazineSize / 2)
+					{
+						Header* page = global.pop();
+						if (page == nullptr)
+							break;
+						local.pages[local.count++] = page;
+					}
+				}
+
+				if (local.count == 0)
+					return nullptr;
+
+				Header* header = local.pages[--local.count];
+				untrim(header, resident_bytes);
+				SCHOBI_ALLOCATOR_STATS_SUB(cached_pages, 1);
+				return header;
 			}
-			
+
 			static void return_to_cache(Header* header)
 			{
-				std::lock_guard<std::mutex> guard(cache_mutex);
-				header->cache_link = cache_header;
-				cache_header = header;
+				trim(header, resident_bytes);
+				SCHOBI_ALLOCATOR_STATS_ADD(cached_pages, 1);
+				if (magazine_retired)
+				{
+					//the thread is shutting down, hand the page straight to the others
+					global.push(header, header);
+					return;
+				}
+
+				Magazine& local = magazine;
+				if (local.count == MagazineSize)
+				{
+					local.spill(MagazineSize / 2);
+				}
+				local.pages[local.count++] = header;
 			}
 
-			static Header* cache_header;
-			static std::mutex cache_mutex;
+			static inline thread_local Magazine magazine;
+			//apart from the magazine, it has to be readable after the magazine got destroyed
+			static constinit inline thread_local bool magazine_retired = false;
+			static inline HeaderStack<page_size> global;
+			static inline std::atomic_size_t resident_bytes = { 0 };
+			static inline std::atomic_size_t cached_pages = { 0 };
 		};
-
-		template<size_t page_size>
-		AllocationImpl::Header* AllocationCache<page_size>::cache_header = nullptr;
-
-		template<size_t page_size>
-		std::mutex AllocationCache<page_size>::cache_mutex;
 	}
 
 	template<typename Label = void, size_t page_size = 64 * 1024>
@@ -113,18 +274,84 @@ namespace schobi
 			static_assert(page_size > sizeof(Header), "page_size must be larger than the Header");
 			static_assert((page_size & (page_size - 1)) == 0, "page_size must be a power of two");
 
-			thread_local detail::AllocationCache<page_size> header;
+			thread_local detail::AllocationCache<page_size> header(counters);
+#if SCHOBI_ENABLE_ALLOCATOR_STATS
+			counters.record_alloc(size);
+#endif
 			return detail::ThreadsafeLinearAllocatorImpl::alloc(header, size, alignment);
 		}
 
-		static SCHOBI_FORCEINLINE void free(void* alloc)
+		//consecutive frees into the same page are collected per thread and applied to its refcount with a single subtraction,
+		//so the refcount line does not bounce between the workers that free into a page. the page is released once the batch is flushed
+		//size is only used for the stats and has to match the allocation
+		static SCHOBI_FORCEINLINE void free(void* alloc, size_t size)
 		{	
+#if SCHOBI_ENABLE_ALLOCATOR_STATS
+			counters.record_free(size);
+#else
+			(void)size;
+#endif
+			Header* header = get_header(alloc);
+			FreeBatch& local = batch;
+			if (local.header == header && local.count < MaxBatchCount)
+			{
+				local.count++;
+				return;
+			}
+			//an oversized block is freed exactly once, batching it would only keep it alive
+			if (header->page_size != page_size)
+			{
+				release(header, 1);
+				return;
+			}
+			if (local.pending.flush == nullptr)
+			{
+				local.pending.flush = &flush;
+				detail::register_pending_frees(&local.pending);
+			}
+			local.flush();
+			local.header = header;
+			local.count = 1;
+		}
+
+		//skips the batch, for callers that need the page back right away
+		static SCHOBI_FORCEINLINE void free_immediately(void* alloc, size_t size)
+		{
+#if SCHOBI_ENABLE_ALLOCATOR_STATS
+			counters.record_free(size);
+#else
+			(void)size;
+#endif
+			release(get_header(alloc), 1);
+		}
+
+		//applies the pending frees of the calling thread
+		static void flush()
+		{
+			batch.flush();
+		}
+
+		static AllocatorStats get_stats()
+		{
+			return counters.snapshot(detail::AllocationCache<page_size>::cached_pages.load(std::memory_order_relaxed));
+		}
+
+	private:
+		static constexpr size_t MaxBatchCount = 256;
+
+		static SCHOBI_FORCEINLINE Header* get_header(void* alloc)
+		{
 			constexpr size_t page_size_minus_one = page_size - 1;
-			Header* header = reinterpret_cast<Header*>(uintptr_t(alloc) & ~uintptr_t(page_size_minus_one));
-			if (header->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			return reinterpret_cast<Header*>(uintptr_t(alloc) & ~uintptr_t(page_size_minus_one));
+		}
+
+		static SCHOBI_FORCEINLINE void release(Header* header, size_t count)
+		{
+			if (header->refcount.fetch_sub(count, std::memory_order_acq_rel) == count)
 			{
 				if (header->page_size == page_size)
 				{
+					SCHOBI_ALLOCATOR_STATS_SUB(counters.pages_in_use, 1);
 					detail::ThreadsafeLinearAllocatorImpl::free_header(header, &detail::AllocationCache<page_size>::return_to_cache);
 				}
 				else
@@ -133,5 +360,29 @@ namespace schobi
 				}
 			}
 		}
+
+		struct FreeBatch
+		{
+			Header* header = nullptr;
+			size_t count = 0;
+			detail::PendingFrees pending;
+
+			~FreeBatch()
+			{
+				flush();
+			}
+
+			void flush()
+			{
+				if (header != nullptr)
+				{
+					release(header, count);
+					header = nullptr;
+					count = 0;
+				}
+			}
+		};
+		static inline thread_local FreeBatch batch;
+		static inline detail::AllocatorCounters counters;
 	};
 }
\ No newline at end of file
@@ -27,6 +27,17 @@
 	#endif
 #endif
 
+#if defined(_WIN32)
+	#define SCHOBI_PLATFORM_WINDOWS 1
+	#define SCHOBI_PLATFORM_LINUX 0
+#elif defined(__linux__)
+	#define SCHOBI_PLATFORM_WINDOWS 0
+	#define SCHOBI_PLATFORM_LINUX 1
+#else
+	#define SCHOBI_PLATFORM_WINDOWS 0
+	#define SCHOBI_PLATFORM_LINUX 0
+#endif
+
 #define SCHOBI_USE_FORCEINLINE 0 
 //!SCHOBI_DEBUG 
 
@@ -36,4 +47,17 @@
 	#define SCHOBI_FORCEINLINE __attribute__((always_inline))
 #else
 	#define SCHOBI_FORCEINLINE
+#endif
+
+//1 uses per worker Chase-Lev deques for the ready queue, 0 the shared pop_all stacks
+#define SCHOBI_USE_WORK_STEALING_DEQUE 1
+
+//1 keeps per worker counters for Scheduler::snapshot_stats on the hot path, 0 compiles them out
+#ifndef SCHOBI_ENABLE_TELEMETRY
+	#define SCHOBI_ENABLE_TELEMETRY 1
+#endif
+
+//1 counts live bytes, pages and frame sizes per linear allocator label for get_stats, 0 compiles them out
+#ifndef SCHOBI_ENABLE_ALLOCATOR_STATS
+	#define SCHOBI_ENABLE_ALLOCATOR_STATS 0
 #endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "common/defines.h"
+
+namespace schobi
+{
+	//bump allocator shared by every frame of one task tree and released in one go once the root finishes.
+	//frees are no-ops, chunks start at 64 KB and double up to 2 MB, threads bump through private windows carved from them
+	class TaskArena
+	{
+	public:
+		static constexpr size_t alignment = 16;
+
+		static TaskArena* create(size_t limit);
+		//every allocation has to be dead by now
+		static void destroy(TaskArena* arena);
+
+		//drops every allocation in O(1) and keeps the chunks for the next round. nothing may allocate concurrently
+		void reset();
+
+		//thread safe, returns nullptr once the next chunk would exceed the limit
+		void* alloc(size_t size);
+		void free(void* pointer);
+
+		//bytes reserved in chunks so far
+		size_t get_reserved_bytes() const
+		{
+			return reserved_bytes.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct Chunk;
+		explicit TaskArena(size_t limit);
+		~TaskArena();
+		char* alloc_shared(size_t size);
+		Chunk* grow(Chunk* full, size_t needed);
+		Chunk* take_retained(size_t needed);
+
+		std::atomic<Chunk*> current = { nullptr };
+		Chunk* oldest = nullptr;						//end of the current chain, so reset can hand it over in one go
+		std::atomic<Chunk*> retained = { nullptr };	//chunks of earlier rounds, only ever popped while allocating
+		std::atomic_size_t reserved_bytes = { 0 };
+		std::atomic_bool exhausted = { false };
+		size_t limit;
+		uint64_t id;
+#if SCHOBI_DEBUG
+		std::atomic_size_t live_allocations = { 0 };
+#endif
+	};
+}
\ No newline at end of file
@@ -12,14 +12,61 @@
 
 #pragma once
 #include <atomic>
+#include <span>
+#include <tuple>
 #include "coroutine/coroutine.h"
 
 namespace schobi
 {
-    struct AwaitAll : public std::suspend_never
+    namespace detail
+    {
+        //every child counts down one shared counter instead of the waiter rescanning them, done() is a single load
+        struct JoinAwaitable : public std::suspend_never
+        {
+            JoinAwaitable() = default;
+            //only moved before it is awaited, so there is no count to carry over
+            JoinAwaitable(JoinAwaitable&&) noexcept
+            {
+            }
+
+            [[nodiscard]]
+            bool done() const noexcept
+            {
+                return joined.remaining.load(std::memory_order_acquire) == 0;
+            }
+
+        protected:
+            //holds one extra count so no child can finish the join before all of them are registered
+            void begin_join(Scheduable* waiter, uint32_t count) noexcept
+            {
+                joined.waiter = waiter;
+                joined.remaining.store(count + 1, std::memory_order_relaxed);
+            }
+
+            //false if every child was done before it could be joined
+            [[nodiscard]]
+            bool end_join(uint32_t already_done) noexcept
+            {
+                return joined.remaining.fetch_sub(already_done + 1, std::memory_order_acq_rel) != already_done + 1;
+            }
+
+            JoinCounter joined;
+        };
+    }
+
+    template<typename T>
+    struct AwaitAll : public detail::JoinAwaitable
     {
         template<uint32_t N>
-        AwaitAll(WaitHandle(&handles)[N]) : handles(handles), count(N)
+        AwaitAll(WaitHandle<T>(&handles)[N]) : handles(handles), count(N)
+        {
+        }
+
+        AwaitAll(WaitHandle<T>* handles, uint32_t count) : handles(handles), count(count)
+        {
+        }
+
+        AwaitAll(std::span<WaitHandle<T>> handles) : handles(handles.data()), count(uint32_t(handles.size()))
         {
         }
 
@@ -38,15 +85,74 @@ namespace schobi
             return true;
         }
 
+        [[nodiscard]]
+        bool subscribe(Scheduable* waiter) noexcept
+        {
+            begin_join(waiter, count);
+            uint32_t already_done = 0;
+            for(uint32_t i = 0; i < count; i++)
+            {
+                already_done += !handles[i].join(&joined);
+            }
+            return end_join(already_done);
+        }
+
     private:
-        WaitHandle* handles;
+        WaitHandle<T>* handles;
         uint32_t count;
     };
 
+    //AwaitAll over handles of different result types
+    template<typename... Ts>
+    struct WhenAll : public detail::JoinAwaitable
+    {
+        WhenAll(WaitHandle<Ts>&... handles) : handles(handles...)
+        {
+        }
+
+        [[nodiscard]]
+        bool await_ready() noexcept
+        {
+            return std::apply([](auto&... handle) { return (handle.await_ready() && ...); }, handles);
+        }
+
+        [[nodiscard]]
+        bool subscribe(Scheduable* waiter) noexcept
+        {
+            begin_join(waiter, sizeof...(Ts));
+            uint32_t already_done = std::apply([this](auto&... handle) { return (uint32_t(!handle.join(&joined)) + ... + 0u); }, handles);
+            return end_join(already_done);
+        }
+
+    private:
+        std::tuple<WaitHandle<Ts>&...> handles;
+    };
+
+    template<typename T>
+    inline AwaitAll<T> when_all(std::span<WaitHandle<T>> handles)
+    {
+        return AwaitAll<T>(handles);
+    }
+
+    template<typename... Ts>
+    inline WhenAll<Ts...> when_all(WaitHandle<Ts>&... handles)
+    {
+        return WhenAll<Ts...>(handles...);
+    }
+
+    template<typename T>
     struct AwaitAny : public std::suspend_never
     {
         template<uint32_t N>
-        AwaitAny(WaitHandle(&handles)[N]) : handles(handles), count(N)
+        AwaitAny(WaitHandle<T>(&handles)[N]) : handles(handles), count(N)
+        {
+        }
+
+        AwaitAny(WaitHandle<T>* handles, uint32_t count) : handles(handles), count(count)
+        {
+        }
+
+        AwaitAny(std::span<WaitHandle<T>> handles) : handles(handles.data()), count(uint32_t(handles.size()))
         {
         }
 
@@ -71,33 +177,155 @@ namespace schobi
         }
 
     private:
-        WaitHandle* handles;
+        WaitHandle<T>* handles;
         uint32_t count;
         uint32_t index = 0;
     };
 
+    //AwaitAny that cancels every other task once the first one is done and only resumes after all of them finished,
+    //so the handles can be dropped right away. the race is polled, draining the losers goes through the join counter
+    template<typename T>
+    struct WhenAny : public detail::JoinAwaitable
+    {
+        template<uint32_t N>
+        WhenAny(WaitHandle<T>(&handles)[N]) : handles(handles), count(N)
+        {
+        }
+
+        WhenAny(WaitHandle<T>* handles, uint32_t count) : handles(handles), count(count)
+        {
+        }
+
+        WhenAny(std::span<WaitHandle<T>> handles) : handles(handles.data()), count(uint32_t(handles.size()))
+        {
+        }
+
+        [[nodiscard]]
+        bool await_ready() noexcept
+        {
+            return find_winner() && all_done();
+        }
+
+        [[nodiscard]]
+        bool done() noexcept
+        {
+            if (joining)
+                return JoinAwaitable::done();
+            return find_winner() && all_done();
+        }
+
+        [[nodiscard]]
+        bool subscribe(Scheduable* waiter) noexcept
+        {
+            if (index == count || joining)
+                return false;
+
+            joining = true;
+            begin_join(waiter, count);
+            uint32_t already_done = 0;
+            for(uint32_t i = 0; i < count; i++)
+            {
+                already_done += !handles[i].join(&joined);
+            }
+            return end_join(already_done);
+        }
+
+        [[nodiscard]]
+        uint32_t await_resume() const noexcept
+        {
+            return index;
+        }
+
+    private:
+        bool find_winner() noexcept
+        {
+            if (index != count)
+                return true;
+
+            for(uint32_t i = 0; i < count; i++)
+            {
+                if(handles[i].valid() && handles[i].await_ready())
+                {
+                    index = i;
+                    for(uint32_t j = 0; j < count; j++)
+                    {
+                        if(j != i)
+                            handles[j].cancel();
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool all_done() const noexcept
+        {
+            for(uint32_t i = 0; i < count; i++)
+            {
+                if(!handles[i].done())
+                    return false;
+            }
+            return true;
+        }
+
+        WaitHandle<T>* handles;
+        uint32_t count;
+        uint32_t index = count;
+        bool joining = false;
+    };
+
+    template<typename T>
+    inline WhenAny<T> when_any(std::span<WaitHandle<T>> handles)
+    {
+        return WhenAny<T>(handles);
+    }
+
+    //co_await cancellation_requested() tells a running task to wrap up, it never suspends
+    struct CancellationCheck : public std::suspend_never
+    {
+        [[nodiscard]]
+        bool await_ready() const noexcept
+        {
+            return true;
+        }
+
+        [[nodiscard]]
+        bool await_resume() const noexcept
+        {
+            return detail::IsCurrentTaskCancelled();
+        }
+    };
+
+    inline CancellationCheck cancellation_requested()
+    {
+        return {};
+    }
+
+    //counting semaphore for tasks. requests are served strictly in arrival order, so a large cost is not starved by a stream of
+    //small ones. waiters push themselves lock free and sleep until release grants them, polling only reads.
+    //granting is done by whichever thread wins the serving flag, everyone else leaves their work to it instead of waiting
     class ResourceLimiter
     {
         class ResourceLimitAwaitable : public std::suspend_never
         {
             friend class ResourceLimiter;
             ResourceLimitAwaitable(const ResourceLimitAwaitable&) = delete;
-            ResourceLimitAwaitable(int64_t cost, std::atomic<int64_t>& resource_limit) : cost(cost), resource_limit(resource_limit)
+            ResourceLimitAwaitable(int64_t cost, ResourceLimiter& limiter) : cost(cost), limiter(limiter)
             {
             }
 
         public:
-            ResourceLimitAwaitable(ResourceLimitAwaitable&& other) : cost(other.cost), resource_limit(other.resource_limit)
+            ResourceLimitAwaitable(ResourceLimitAwaitable&& other) : cost(other.cost), limiter(other.limiter), acquired(other.acquired)
             {
-                other.cost = 0;
+                other.acquired = false;
             }
 
             void release()
             {
-                if(cost != 0)
+                if(acquired)
                 {
-                    resource_limit.fetch_add(cost, std::memory_order_relaxed);
-                    cost = 0;
+                    limiter.release(cost);
+                    acquired = false;
                 }
             }
 
@@ -107,46 +335,231 @@ namespace schobi
             }
 
             [[nodiscard]]
-            bool done()
+            bool done() const noexcept
             {
-                return resource_limit.load(std::memory_order_relaxed) >= cost;
+                return granted.load(std::memory_order_acquire);
             }
 
             [[nodiscard]]
-            bool await_ready() const noexcept
+            bool await_ready() noexcept
             {
-                return resource_limit.fetch_add(cost, std::memory_order_relaxed) > 0ll;
+                return limiter.try_acquire(cost);
             }
 
+            [[nodiscard]]
+            bool subscribe(Scheduable* in_waiter) noexcept
+            {
+                waiter = in_waiter;
+                scheduler = &Scheduler::parking();
+                return limiter.enqueue(this);
+            }
+
+            //the waiter was cancelled after it got granted, so nobody takes the cost over
+            void abandon() noexcept
+            {
+                if(granted.load(std::memory_order_relaxed))
+                {
+                    limiter.release(cost);
+                }
+            }
+
+            //the returned scope gives the cost back when it goes out of scope
             [[nodiscard]]
             ResourceLimitAwaitable await_resume() noexcept
             {
-                resource_limit.fetch_sub(cost, std::memory_order_relaxed);
+                acquired = true;
                 return std::move(*this);
             }
 
         private:
             int64_t cost;
-            std::atomic<int64_t>& resource_limit;
+            ResourceLimiter& limiter;
+            bool acquired = false;
+            std::atomic_bool granted = { false };
+            Scheduable* waiter = nullptr;
+            Scheduler* scheduler = nullptr;
+
+        public:
+            //intrusive link of the waiter stack, only the limiter touches it
+            ResourceLimitAwaitable* next = nullptr;
         };
 
     public:
         ResourceLimiter(ResourceLimiter&&) = delete;
         ResourceLimiter(const ResourceLimiter&) = delete;
-        ResourceLimiter(int64_t limit) : limit(max(limit, 1ll)), resource_limit(limit)
+        ResourceLimiter(int64_t limit) : limit(max(limit, 1ll)), available(this->limit)
         {
         }
         ~ResourceLimiter();
 
+        //nothing is taken until the request is awaited, costs above the limit are clamped to it
+        [[nodiscard]]
         ResourceLimitAwaitable request(int64_t cost = 1)
         {
-            cost = max(cost, 0ll);
-            resource_limit.fetch_sub(cost, std::memory_order_relaxed);
-            return ResourceLimitAwaitable(cost, resource_limit);
+            return ResourceLimitAwaitable(clamp(cost, 0ll, limit), *this);
+        }
+
+        //takes cost without waiting, fails when it does not fit or others are already queued. pair with release
+        [[nodiscard]]
+        bool try_acquire(int64_t cost = 1);
+
+        //gives back cost at once and wakes exactly the waiters that fit now, in arrival order
+        void release(int64_t cost = 1);
+
+        [[nodiscard]]
+        int64_t get_available() const
+        {
+            return available.load(std::memory_order_relaxed);
         }
 
     private:
+        //queues the awaitable unless its cost fits right away, then it is granted and false is returned
+        bool enqueue(ResourceLimitAwaitable* awaitable);
+        bool take(int64_t cost);
+        //grants the queued waiters that fit, returns whether self was one of them. self is granted but not scheduled
+        bool serve(const ResourceLimitAwaitable* self);
+
         int64_t limit;
-        std::atomic<int64_t> resource_limit;
+        std::atomic<int64_t> available;
+        //waiters pushed and not granted yet
+        std::atomic_uint32_t queued = { 0 };
+        //newest first, moved over to the fifo by whoever serves
+        std::atomic<ResourceLimitAwaitable*> incoming = { nullptr };
+        std::atomic_bool serving = { false };
+        //arrival order, only touched while serving
+        ResourceLimitAwaitable* waiters_head = nullptr;
+        ResourceLimitAwaitable* waiters_tail = nullptr;
+    };
+
+    //mutex for tasks, a contended lock parks the task instead of the worker. waiters push their awaitable intrusively,
+    //unlock hands the ownership straight to the longest waiting one and schedules it on the scheduler it parked on
+    class AsyncMutex
+    {
+    public:
+        class [[nodiscard]] LockGuard
+        {
+            friend class AsyncMutex;
+            LockGuard(const LockGuard&) = delete;
+            LockGuard(AsyncMutex* mutex) : mutex(mutex)
+            {
+            }
+
+        public:
+            LockGuard(LockGuard&& other) : mutex(other.mutex)
+            {
+                other.mutex = nullptr;
+            }
+
+            ~LockGuard()
+            {
+                unlock();
+            }
+
+            void unlock()
+            {
+                if(mutex)
+                {
+                    mutex->unlock();
+                    mutex = nullptr;
+                }
+            }
+
+        private:
+            AsyncMutex* mutex;
+        };
+
+    private:
+        class LockAwaitable : public std::suspend_never
+        {
+            friend class AsyncMutex;
+            LockAwaitable(AsyncMutex& mutex) : mutex(mutex)
+            {
+            }
+
+        public:
+            //true once the lock is ours, a subscribed waiter only runs again after unlock handed it over
+            [[nodiscard]]
+            bool done() const noexcept
+            {
+                return owned;
+            }
+
+            [[nodiscard]]
+            bool await_ready() noexcept
+            {
+                owned = mutex.try_lock();
+                return owned;
+            }
+
+            [[nodiscard]]
+            bool subscribe(Scheduable* in_waiter) noexcept
+            {
+                //either the mutex turned free and enqueue takes it right away, or unlock hands it over before the waiter runs again.
+                //set before the waiter is published, another worker may resume it right after
+                owned = true;
+                waiter = in_waiter;
+                scheduler = &Scheduler::parking();
+                return mutex.enqueue(this);
+            }
+
+            //the waiter was cancelled after the lock was handed to it, so it passes it on right away
+            void abandon() noexcept
+            {
+                if(owned)
+                {
+                    owned = false;
+                    mutex.unlock();
+                }
+            }
+
+            [[nodiscard]]
+            LockGuard await_resume() noexcept
+            {
+                return LockGuard(&mutex);
+            }
+
+        private:
+            AsyncMutex& mutex;
+            bool owned = false;
+            Scheduable* waiter = nullptr;
+            Scheduler* scheduler = nullptr;
+
+        public:
+            //intrusive link of the waiter stack, only the mutex touches it
+            LockAwaitable* next = nullptr;
+        };
+
+    public:
+        AsyncMutex() = default;
+        AsyncMutex(AsyncMutex&&) = delete;
+        AsyncMutex(const AsyncMutex&) = delete;
+        ~AsyncMutex();
+
+        //co_await mutex.lock() yields a guard that unlocks when it goes out of scope
+        [[nodiscard]]
+        LockAwaitable lock() noexcept
+        {
+            return LockAwaitable(*this);
+        }
+
+        [[nodiscard]]
+        bool try_lock() noexcept
+        {
+            LockAwaitable* expected = Unlocked;
+            return state.compare_exchange_strong(expected, nullptr, std::memory_order_acquire, std::memory_order_relaxed);
+        }
+
+        //only the owner may unlock
+        void unlock();
+
+    private:
+        //pushes the waiter unless the mutex turned free in the meantime, then it takes the lock and returns false instead
+        bool enqueue(LockAwaitable* awaitable) noexcept;
+
+        //Unlocked, nullptr for locked without waiters, or the newest waiter of a lifo stack
+        static inline LockAwaitable* const Unlocked = reinterpret_cast<LockAwaitable*>(0x1);
+        std::atomic<LockAwaitable*> state = { Unlocked };
+        //waiters in arrival order, only touched by the owner
+        LockAwaitable* waiting = nullptr;
     };
 }
\ No newline at end of file
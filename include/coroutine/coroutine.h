@@ -12,8 +12,11 @@
 
 #pragma once
 #include <coroutine>
-#include <latch>
+#include <optional>
+#include <type_traits>
+#include "common/allocator.h"
 #include "common/defines.h"
+#include "common/taskarena.h"
 #include "common/utility.h"
 #include "scheduler/scheduler.h"
 
@@ -24,47 +27,106 @@ namespace schobi
         Inherited   = 0,
         LongLived   = 1 << 0,
         ShortLived  = 1 << 1,
+        //ShortLived for the whole task tree, all descendant frames come from an arena released when this root finishes
+        TaskArena   = 1 << 2,
 
         Default = LongLived,
     };
 
+    //cancels every task created with it and all their descendants, it has to outlive them.
+    //tasks that did not start yet are finished without running, running ones check through cancellation_requested()
+    class CancellationSource
+    {
+    public:
+        void cancel() noexcept
+        {
+            cancelled.store(true, std::memory_order_relaxed);
+        }
+
+        [[nodiscard]]
+        bool is_cancelled() const noexcept
+        {
+            return cancelled.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic_bool cancelled = { false };
+    };
+
     struct AsyncTaskDesc
     {
         SchedulingFlags flags = SchedulingFlags::Default;
         int32_t priority = 0;
+        //only used with SchedulingFlags::TaskArena, frames past the limit fall back to the linear allocator
+        size_t arena_limit = 64 * 1024 * 1024;
+        //nullptr inherits the source of the task this one is created in
+        const CancellationSource* cancellation = nullptr;
     };
 
+    //the linear allocator behind ShortLived frames, see SCHOBI_ENABLE_ALLOCATOR_STATS
+    AllocatorStats get_frame_allocator_stats();
+
+    template<typename T = void>
+    class Coroutine;
+    template<typename T = void>
     class AsyncTask;
+    template<typename T = void>
     class WaitHandle;
+    template<typename T = void>
+    class AsyncTaskBatch;
 
     namespace detail
     {
         struct ScheduablePromise;
-        class SetScopedSchedulingFlags
-        {
-            SchedulingFlags old_flags;
-        public:
-            SetScopedSchedulingFlags(const ScheduablePromise& root);
-            ~SetScopedSchedulingFlags();
-        };
-
         class SetScopedStackRoot
         {
         public:
             SetScopedStackRoot(const ScheduablePromise* root);
             ~SetScopedStackRoot();
+
+        private:
+            TaskArena* outer_arena;
         };
 
         struct Awaitable
         {
             virtual bool done() noexcept = 0;
+            //registers the waiter to be scheduled once done() turns true, false if that is not supported
+            virtual bool subscribe(Scheduable* /*waiter*/) noexcept { return false; }
+            //the task got cancelled and finishes here instead of resuming, whatever the awaitable was handed has to be given back
+            virtual void abandon() noexcept {}
         };
 
         struct SetAwaitableAtRoot
         {
             SetAwaitableAtRoot(Awaitable* awaitable);
         };
+        //the frame the root resumes the next time it gets executed
+        void SetActiveFrameAtRoot(std::coroutine_handle<> frame);
         SchedulingFlags GetSchedulingFlags();
+        const CancellationSource* GetCurrentCancellation();
+        //false outside of a task
+        bool IsCurrentTaskCancelled();
+        TaskArena* GetCurrentArena();
+        //frames created by the calling thread outside of a running task come from this arena unless they are LongLived
+        void SetCurrentArena(TaskArena* arena);
+
+        //until EndFrameBatch every frame allocated by the calling thread takes the next slot of one cache line aligned block.
+        //all frames have to be of the same coroutine, their frees are no-ops and FreeFrameBatch releases the block
+        void BeginFrameBatch(uint32_t count);
+        [[nodiscard]]
+        void* EndFrameBatch();
+        void FreeFrameBatch(void* block);
+
+        //shared by all children of one join, the child that counts it down to zero hands the waiter back to the scheduler
+        struct JoinCounter
+        {
+            std::atomic_uint32_t remaining = { 1 };
+            Scheduable* waiter = nullptr;
+        };
+
+        //a joined child stores the tagged counter in place of its waiter
+        static constexpr uintptr_t JoinTag = 0x2;
 
         template<typename T>
         concept IsAwaitable = requires (T t, std::coroutine_handle<> h)
@@ -80,6 +142,18 @@ namespace schobi
             { t.done() } -> std::convertible_to<bool>;
         };
 
+        template<typename T>
+        concept HasSubscribeMethod = requires (T t, Scheduable* waiter)
+        {
+            { t.subscribe(waiter) } -> std::convertible_to<bool>;
+        };
+
+        template<typename T>
+        concept HasAbandonMethod = requires (T t)
+        {
+            { t.abandon() };
+        };
+
         template<IsAwaitable NestedAwaitable>
         struct TransformAwaitable : Awaitable
         {
@@ -94,6 +168,20 @@ namespace schobi
                     return nested_awaitable.await_ready();
             }
 
+            bool subscribe(Scheduable* waiter) noexcept override
+            {
+                if constexpr (HasSubscribeMethod<NestedAwaitable>)
+                    return nested_awaitable.subscribe(waiter);
+                else
+                    return false;
+            }
+
+            void abandon() noexcept override
+            {
+                if constexpr (HasAbandonMethod<NestedAwaitable>)
+                    nested_awaitable.abandon();
+            }
+
             bool await_ready() noexcept
             {
                 return nested_awaitable.await_ready();
@@ -123,7 +211,52 @@ namespace schobi
         };
 
         void* coro_malloc(size_t size, SchedulingFlags flags);
-        void  coro_free(void* pointer);
+        void  coro_free(void* pointer, size_t size);
+
+        template<typename T>
+        concept IsNestedCall = requires (T t)
+        {
+            { std::move(t).operator co_await() } -> IsAwaitable;
+        };
+
+        //starts a nested coroutine by symmetric transfer and makes it the frame the root resumes
+        template<typename PromiseType>
+        struct NestedCallAwaitable
+        {
+            std::coroutine_handle<PromiseType> child;
+
+            bool await_ready() const noexcept
+            {
+                return child.done();
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> parent) noexcept
+            {
+                child.promise().continuation = parent;
+                SetActiveFrameAtRoot(child);
+                return child;
+            }
+
+            auto await_resume() noexcept
+            {
+                return child.promise().take_result();
+            }
+        };
+
+        //returns to the parent by symmetric transfer, a root returns to whoever resumed it
+        struct FinalAwaitable : std::suspend_always
+        {
+            template<typename PromiseType>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<PromiseType> handle) const noexcept
+            {
+                if (std::coroutine_handle<> parent = handle.promise().continuation)
+                {
+                    SetActiveFrameAtRoot(parent);
+                    return parent;
+                }
+                return std::noop_coroutine();
+            }
+        };
 
         struct Promise
         {
@@ -133,33 +266,102 @@ namespace schobi
                 return TransformAwaitable<T>(std::move(nested_awaitable));
             }
 
+            template<IsNestedCall T>
+            T&& await_transform(T&& nested_call) const noexcept
+            {
+                return std::forward<T>(nested_call);
+            }
+
             void unhandled_exception();
-            constexpr void return_void() const noexcept {}
             constexpr std::suspend_always initial_suspend() const noexcept { return {}; }
-            constexpr std::suspend_always final_suspend() const noexcept { return {}; }
+            constexpr FinalAwaitable final_suspend() const noexcept { return {}; }
 
             void* operator new(size_t size)
             {
                 return coro_malloc(size, SchedulingFlags::Inherited);
             }
-            void operator delete(void* pointer)
+            void operator delete(void* pointer, size_t size)
             {
-                coro_free(pointer);
+                coro_free(pointer, size);
             }
-            constexpr Promise* get_return_object() noexcept { return this; }
+
+            std::coroutine_handle<> continuation;
         };
 
-        struct ScheduablePromise : Scheduable, Promise
+        //the result lives inline in the promise and is moved out exactly once
+        template<typename T>
+        struct ReturnValue
+        {
+            static_assert(!std::is_reference_v<T>, "coroutines cannot return references");
+
+            void return_value(const T& value)
+            {
+                result.emplace(value);
+            }
+
+            void return_value(T&& value)
+            {
+                result.emplace(std::move(value));
+            }
+
+            [[nodiscard]]
+            T take_result()
+            {
+                expects(result.has_value(), "coroutine has no result");
+                return std::move(*result);
+            }
+
+            //empty if the coroutine never reached its co_return
+            [[nodiscard]]
+            std::optional<T> take_optional_result()
+            {
+                std::optional<T> out = std::move(result);
+                result.reset();
+                return out;
+            }
+
+        private:
+            std::optional<T> result;
+        };
+
+        template<>
+        struct ReturnValue<void>
         {
-            using handle_type = std::coroutine_handle<ScheduablePromise>;
+            constexpr void return_void() const noexcept {}
+            constexpr void take_result() const noexcept {}
+        };
 
+        template<typename T>
+        struct CoroutinePromise final : Promise, ReturnValue<T>
+        {
+            CoroutinePromise* get_return_object() noexcept { return this; }
+        };
+
+        struct ScheduablePromise : Scheduable, Promise
+        {
             template<typename... Args>
-            ScheduablePromise(AsyncTaskDesc desc, Args&&...) : Scheduable(desc.priority), flags(desc.flags)
+            ScheduablePromise(AsyncTaskDesc desc, Args&&...) : Scheduable(desc.priority), flags(desc.flags), cancellation(desc.cancellation)
             {
+                if (!cancellation)
+                {
+                    cancellation = GetCurrentCancellation();
+                }
+
                 if (flags == SchedulingFlags::Inherited)
                 {
                     flags = GetSchedulingFlags();
                 }
+
+                //everything that is not LongLived joins the arena of the tree it was created in
+                if (desc.flags == SchedulingFlags::TaskArena)
+                {
+                    arena = TaskArena::create(desc.arena_limit);
+                    owns_arena = true;
+                }
+                else if (flags != SchedulingFlags::LongLived)
+                {
+                    arena = GetCurrentArena();
+                }
             }
 
             ~ScheduablePromise();
@@ -167,12 +369,18 @@ namespace schobi
             [[nodiscard]]
             bool done() const
             {
-                return safely_done.try_wait();
+                return (state.load(std::memory_order_acquire) & DoneFlag) != 0;
             }
 
-            void wait() const
+            //blocks on the state word until the task is done
+            void wait();
+
+            //only a single waiter is supported, fails if the coroutine already finished
+            [[nodiscard]]
+            bool subscribe(Scheduable* in_waiter)
             {
-                safely_done.wait();
+                Scheduable* expected = nullptr;
+                return waiter.compare_exchange_strong(expected, in_waiter, std::memory_order_acq_rel, std::memory_order_acquire);
             }
 
             template<typename... Args>
@@ -183,41 +391,84 @@ namespace schobi
 
             void set_dependency(Awaitable* in_awaitable) const;
 
+            //cancelled by itself or through the source it inherited
+            [[nodiscard]]
+            bool is_cancelled() const
+            {
+                return Scheduable::is_cancelled() || (cancellation && cancellation->is_cancelled());
+            }
+
+            //bytes the arena of this root reserved, valid once done
+            [[nodiscard]]
+            size_t get_arena_bytes() const
+            {
+                return arena_bytes;
+            }
+
+        protected:
+            //the frame has to be derived from the most derived promise type
+            void set_frame(std::coroutine_handle<> in_frame)
+            {
+                frame = in_frame;
+                active = in_frame;
+            }
+
         private:
             [[nodiscard]]
-            Scheduable* execute() override;
+            Scheduable* execute();
+
+            [[nodiscard]]
+            bool is_ready() const;
 
             [[nodiscard]]
-            bool is_ready() const override;
+            bool park();
+
+            void mark_done();
+            void release_arena();
 
+            //everything the scheduler touches per execution directly follows the 16 byte header
             mutable Awaitable* awaitable = nullptr;
-            std::latch safely_done{ 1 };
-            friend class SetScopedStackRoot;
-            friend class SetScopedSchedulingFlags;
+            mutable std::coroutine_handle<> active;
+            std::atomic<Scheduable*> waiter{ nullptr };
+            std::coroutine_handle<> frame;
             mutable SchedulingFlags flags = SchedulingFlags::Inherited;
-            int32_t priority_adjustment = 0;
+            bool owns_arena = false;
+            bool started = false;
+            TaskArena* arena = nullptr;
+            size_t arena_bytes = 0;
+            const CancellationSource* cancellation;
+            friend struct schobi::Scheduable;
+            friend class SetScopedStackRoot;
+            friend void SetActiveFrameAtRoot(std::coroutine_handle<> frame);
+            friend const CancellationSource* GetCurrentCancellation();
         };
 
         template<typename T>
-        concept IsCoroCallable = requires (T t)
+        struct TaskPromise final : ScheduablePromise, ReturnValue<T>
         {
-            { t.internal_use_done() } -> std::same_as<bool>;
-            { t.internal_use_only() } -> std::same_as<void*>;
+            template<typename... Args>
+            TaskPromise(AsyncTaskDesc desc, Args&&... args) : ScheduablePromise(desc, std::forward<Args>(args)...)
+            {
+                set_frame(std::coroutine_handle<TaskPromise>::from_promise(*this));
+            }
+
+            TaskPromise* get_return_object() noexcept { return this; }
         };
     }//namespace detail
 
+    template<typename T>
     class Coroutine
     {
-        using handle_type = std::coroutine_handle<detail::Promise>;
+        using handle_type = std::coroutine_handle<detail::CoroutinePromise<T>>;
 
     public:
-        using promise_type = detail::Promise;
+        using promise_type = detail::CoroutinePromise<T>;
        
         Coroutine() = delete;
         Coroutine(Coroutine&&) = delete;
         Coroutine(const Coroutine&) = delete;
         
-        Coroutine(detail::Promise* promise) noexcept : handle(handle_type::from_promise(*promise))
+        Coroutine(promise_type* promise) noexcept : handle(handle_type::from_promise(*promise))
         {
         }
 
@@ -226,29 +477,24 @@ namespace schobi
             handle.destroy();
         };
 
+        //co_await runs the coroutine as a nested call of the awaiting coroutine and yields its result
         [[nodiscard]]
-        bool internal_use_done() const noexcept
+        detail::NestedCallAwaitable<promise_type> operator co_await() && noexcept
         {
-            return handle.done();
-        }
-
-        [[nodiscard]]
-        void* internal_use_only() const noexcept
-        {
-            return handle.address();
+            return { handle };
         }
 
     private:
         handle_type handle;
     };
 
-    class WaitHandle;
+    template<typename T>
     class AsyncTask
     {
-        using handle_type = std::coroutine_handle<detail::ScheduablePromise>;
+        using handle_type = std::coroutine_handle<detail::TaskPromise<T>>;
 
     public:
-        using promise_type = detail::ScheduablePromise;
+        using promise_type = detail::TaskPromise<T>;
         
         AsyncTask() = default;
         AsyncTask(const AsyncTask&) = delete;
@@ -264,7 +510,7 @@ namespace schobi
             other.handle = nullptr;
         }
 
-        AsyncTask(detail::Promise* promise) noexcept : handle(handle_type::from_promise(*static_cast<detail::ScheduablePromise*>(promise)))
+        AsyncTask(promise_type* promise) noexcept : handle(handle_type::from_promise(*promise))
         {
         }
 
@@ -272,27 +518,21 @@ namespace schobi
         {
             if (handle)
             {
-                detail::SetScopedSchedulingFlags scope(handle.promise());
                 handle.destroy();
             }
         };
 
+        //co_await runs the task inline as a nested call of the awaiting coroutine instead of scheduling it
         [[nodiscard]]
-        bool internal_use_done() const noexcept
+        detail::NestedCallAwaitable<promise_type> operator co_await() && noexcept
         {
-            return handle ? handle.done() : true;
+            return { handle };
         }
 
-        [[nodiscard]]
-        void* internal_use_only() const noexcept
-        {
-            return handle.address();
-        }
-
-        auto schedule();
+        WaitHandle<T> schedule(Scheduler& scheduler = Scheduler::current());
 
         template<uint32_t N>
-        static void schedule_evenly(WaitHandle(&dest)[N], AsyncTask(&source)[N]);
+        static void schedule_evenly(WaitHandle<T>(&dest)[N], AsyncTask(&source)[N], Scheduler& scheduler = Scheduler::current());
 
     private:
         Scheduable* get_scheduable()
@@ -300,18 +540,21 @@ namespace schobi
             return handle ? &handle.promise() : nullptr;
         }
 
-        friend class WaitHandle;
+        friend class WaitHandle<T>;
         handle_type handle;
     };
 
+    template<typename T>
     class WaitHandle : public std::suspend_never
     {
-        using handle_type = std::coroutine_handle<detail::ScheduablePromise>;
+        using handle_type = std::coroutine_handle<detail::TaskPromise<T>>;
+        template<typename>
+        friend class AsyncTaskBatch;
 
     public:
         WaitHandle() = default;
         WaitHandle(const WaitHandle&) = delete;
-        WaitHandle(AsyncTask&& task) : handle(std::move(task.handle))
+        WaitHandle(AsyncTask<T>&& task) : handle(std::move(task.handle))
         {
             task.handle = nullptr;
         }
@@ -331,7 +574,6 @@ namespace schobi
         {
             if (handle)
             {
-                detail::SetScopedSchedulingFlags scope(handle.promise());
                 handle.destroy();
             }
         };
@@ -342,6 +584,22 @@ namespace schobi
                 handle.promise().wait();
         }
 
+        //blocks until the task is done and moves the result out, a task that was cancelled before it finished has none
+        T get()
+        {
+            expects(valid(), "WaitHandle has no task");
+            wait();
+            return handle.promise().take_result();
+        }
+
+        //like get(), but empty if the task was cancelled before it reached its co_return
+        std::optional<T> try_get() requires (!std::is_void_v<T>)
+        {
+            expects(valid(), "WaitHandle has no task");
+            wait();
+            return handle.promise().take_optional_result();
+        }
+
         [[nodiscard]]
         bool valid() const noexcept
         {
@@ -354,26 +612,69 @@ namespace schobi
             return handle ? handle.promise().done() : true;
         }
 
+        //the task finishes without a result before it starts or at its next suspension point, a running one sees it through
+        //cancellation_requested(). tasks it keeps handles to across a suspension point have to be cancelled along with it
+        void cancel() noexcept
+        {
+            if (handle)
+                handle.promise().cancel();
+        }
+
+        [[nodiscard]]
+        bool cancelled() const noexcept
+        {
+            return handle && handle.promise().is_cancelled();
+        }
+
+        //peak arena footprint of a SchedulingFlags::TaskArena root
+        [[nodiscard]]
+        size_t get_arena_bytes() const noexcept
+        {
+            expects(done(), "arena usage is only known once the task is done");
+            return handle ? handle.promise().get_arena_bytes() : 0;
+        }
+
         [[nodiscard]]
         bool await_ready() const noexcept
         {
             return done();
         }
 
+        T await_resume()
+        {
+            if constexpr (!std::is_void_v<T>)
+                return handle.promise().take_result();
+        }
+
+        [[nodiscard]]
+        bool subscribe(Scheduable* waiter) noexcept
+        {
+            return handle && handle.promise().subscribe(waiter);
+        }
+
+        //counts down the counter once the task is done, fails if it already is
+        [[nodiscard]]
+        bool join(detail::JoinCounter* counter) noexcept
+        {
+            return handle && handle.promise().subscribe(reinterpret_cast<Scheduable*>(reinterpret_cast<uintptr_t>(counter) | detail::JoinTag));
+        }
+
     private:
         handle_type handle;
     };
 
-    inline SCHOBI_FORCEINLINE auto AsyncTask::schedule()
+    template<typename T>
+    inline SCHOBI_FORCEINLINE WaitHandle<T> AsyncTask<T>::schedule(Scheduler& scheduler)
     {
         Scheduable* scheduable = get_scheduable();
         if(scheduable)
-            Scheduler::schedule_locally(scheduable);
-        return WaitHandle(std::move(*this));
+            Scheduler::schedule_locally(scheduable, scheduler);
+        return WaitHandle<T>(std::move(*this));
     }
 
+    template<typename T>
     template<uint32_t N>
-    inline void AsyncTask::schedule_evenly(WaitHandle(&dest)[N], AsyncTask(&source)[N])
+    inline void AsyncTask<T>::schedule_evenly(WaitHandle<T>(&dest)[N], AsyncTask(&source)[N], Scheduler& scheduler)
     {
         Scheduable* group = nullptr;
         for (uint32_t i = 0; i < N; i++)
@@ -385,21 +686,6 @@ namespace schobi
             }
             dest[i] = std::move(source[i]);
         }
-        Scheduler::schedule_evenly(group);
+        Scheduler::schedule_evenly(group, scheduler);
     }
-}//namespace schobi
-
-//to support return types this extention would be needed
-//https://gcc.gnu.org/onlinedocs/gcc/Statement-Exprs.html
-#define co_call(expr)                                                                    \
-{                                                                                        \
-    static_assert(schobi::detail::IsCoroCallable<decltype(expr)>, "cannot CO_CALL expr");\
-    const auto& _schobi_coro = expr;                                                     \
-    if(!_schobi_coro.internal_use_done())                                                \
-        __builtin_coro_resume(_schobi_coro.internal_use_only());                         \
-    while(!_schobi_coro.internal_use_done())                                             \
-    {                                                                                    \
-        co_await std::suspend_always();                                                  \
-        __builtin_coro_resume(_schobi_coro.internal_use_only());                         \
-    }                                                                                    \
-}
\ No newline at end of file
+}//namespace schobi
\ No newline at end of file
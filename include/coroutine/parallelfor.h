@@ -11,19 +11,19 @@
 //WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
-#include "coroutine/awaitables.h"
+#include "coroutine/taskbatch.h"
 
 namespace schobi
 {
     template<uint32_t MaxWorkers, typename Coro>
-    Coroutine parallel_for(uint32_t count, const Coro& lambda)
+    Coroutine<> parallel_for(uint32_t count, const Coro& lambda)
     {
         if(count == 0)
             co_return;
 
         struct Internal
         {
-            static AsyncTask worker(AsyncTaskDesc desc, std::atomic_uint32_t& atomic, const Coro& lambda, uint32_t count, uint32_t num_worker)
+            static AsyncTask<> worker(AsyncTaskDesc desc, std::atomic_uint32_t& atomic, const Coro& lambda, uint32_t count, uint32_t num_worker)
             {
                 constexpr uint32_t split_target = 5u;
                 uint32_t batch_size = max(1u, count / num_worker / split_target);
@@ -36,7 +36,7 @@ namespace schobi
                     uint32_t end_index = min(count, start_index + batch_size);
                     for(uint32_t i = start_index; i < end_index; i++)
                     {
-                        co_call(lambda(i));
+                        co_await lambda(i);
                     }
                     batch_size = max(1u, (count - start_index) / num_worker / split_target);
                 }
@@ -51,15 +51,13 @@ namespace schobi
         desc.flags = SchedulingFlags::ShortLived;
         desc.priority = INT32_MAX;
 
-        AsyncTask tasks[MaxWorkers];
-        WaitHandle waits[MaxWorkers];
-        for(uint32_t i = 0; i < num_worker; i++)
+        AsyncTaskBatch<> workers(num_worker, [&](uint32_t)
         {
-            tasks[i] = Internal::worker(desc, atomic, lambda, count, num_worker + 1);
-        }
-        AsyncTask::schedule_evenly(waits, tasks);
-        co_call(Internal::worker(desc, atomic, lambda, count, num_worker + 1));
+            return Internal::worker(desc, atomic, lambda, count, num_worker + 1);
+        });
+        workers.schedule();
+        co_await Internal::worker(desc, atomic, lambda, count, num_worker + 1);
 
-        co_await AwaitAll(waits);
+        co_await workers.await_all();
     }
 }
\ No newline at end of file
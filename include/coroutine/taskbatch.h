@@ -0,0 +1,102 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include "coroutine/awaitables.h"
+
+namespace schobi
+{
+    //count instances of the same task created by factory(index) in one contiguous block, every frame on its own cache lines.
+    //the tasks are linked in place for a single schedule call and their frames go away together with the batch
+    template<typename T>
+    class AsyncTaskBatch
+    {
+    public:
+        AsyncTaskBatch(const AsyncTaskBatch&) = delete;
+        AsyncTaskBatch(AsyncTaskBatch&&) = delete;
+
+        //factory must create exactly one coroutine, e.g. return worker(desc, index)
+        template<typename Factory>
+        AsyncTaskBatch(uint32_t count, Factory&& factory) : handles(new WaitHandle<T>[count]), count(count)
+        {
+            detail::BeginFrameBatch(count);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                handles[i] = WaitHandle<T>(factory(i));
+            }
+            block = detail::EndFrameBatch();
+
+            for (uint32_t i = 0; i + 1 < count; i++)
+            {
+                get_scheduable(i)->next = get_scheduable(i + 1);
+            }
+        }
+
+        //the tasks have to be done or never scheduled
+        ~AsyncTaskBatch()
+        {
+            delete[] handles;
+            detail::FreeFrameBatch(block);
+        }
+
+        void schedule(Scheduler& scheduler = Scheduler::current())
+        {
+            if (count != 0)
+            {
+                Scheduler::schedule_evenly(get_scheduable(0), scheduler);
+            }
+        }
+
+        [[nodiscard]]
+        AwaitAll<T> await_all() noexcept
+        {
+            return AwaitAll<T>(handles, count);
+        }
+
+        void wait() const noexcept
+        {
+            for (uint32_t i = 0; i < count; i++)
+            {
+                handles[i].wait();
+            }
+        }
+
+        //the frames belong to the batch, so the handles cannot be moved out
+        const WaitHandle<T>& operator[](uint32_t index) const
+        {
+            expects(index < count, "batch index out of range");
+            return handles[index];
+        }
+
+        //blocks until the task at index is done and moves its result out
+        T get(uint32_t index)
+        {
+            expects(index < count, "batch index out of range");
+            return handles[index].get();
+        }
+
+        [[nodiscard]]
+        uint32_t size() const noexcept
+        {
+            return count;
+        }
+
+    private:
+        Scheduable* get_scheduable(uint32_t index) const
+        {
+            return &handles[index].handle.promise();
+        }
+
+        WaitHandle<T>* handles;
+        void* block = nullptr;
+        uint32_t count;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include "coroutine/coroutine.h"
+
+namespace schobi
+{
+    //game loop style frames: every frame that is not LongLived and gets created between begin and end, by the calling thread or by
+    //the tasks of the frame, bump allocates from one arena. end waits until the frame is quiescent and resets the arena in O(1)
+    class TaskFrame
+    {
+    public:
+        explicit TaskFrame(size_t arena_limit = 64 * 1024 * 1024);
+        TaskFrame(TaskFrame&&) = delete;
+        TaskFrame(const TaskFrame&) = delete;
+        ~TaskFrame();
+
+        //binds the arena to the calling thread, which must not be a worker
+        void begin();
+        //schedules a root of this frame, end waits for it
+        void spawn(AsyncTask<>&& task, Scheduler& scheduler = Scheduler::current());
+        //waits for every spawned task and resets the arena, other WaitHandles of this frame have to be gone by now
+        void end();
+
+        //bytes the arena holds, they stay reserved from frame to frame
+        [[nodiscard]]
+        size_t get_reserved_bytes() const;
+
+    private:
+        TaskArena* arena;
+        WaitHandle<>* spawned = nullptr;
+        uint32_t spawned_count = 0;
+        uint32_t spawned_capacity = 0;
+        bool active = false;
+    };
+}
\ No newline at end of file
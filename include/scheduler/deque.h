@@ -0,0 +1,118 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include "common/utility.h"
+#include "stack.h"
+
+namespace schobi
+{
+	//Chase-Lev deque with a fixed capacity ring, memory orderings after Le et al. "Correct and Efficient Work-Stealing for Weak Memory Models".
+	//The owning thread pushes and pops at the bottom (LIFO), any other thread steals from the top (FIFO).
+	template<IntrusiveConstraint NodeType, uint32_t Capacity = 1024>
+	class WorkStealingDeque
+	{
+		static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+		static constexpr int64_t mask = int64_t(Capacity) - 1;
+
+		alignas(64) std::atomic_int64_t top{ 0 };
+		alignas(64) std::atomic_int64_t bottom{ 0 };
+		alignas(64) std::atomic<NodeType*> items[Capacity] = {};
+
+	public:
+		//owner only, returns false if the ring is full
+		bool push(NodeType* node)
+		{
+			const int64_t b = bottom.load(std::memory_order_relaxed);
+			const int64_t t = top.load(std::memory_order_acquire);
+			if (b - t >= int64_t(Capacity))
+				return false;
+
+			items[b & mask].store(node, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		//owner only
+		NodeType* pop()
+		{
+			const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t t = top.load(std::memory_order_relaxed);
+			if (t > b)
+			{
+				bottom.store(b + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			NodeType* node = items[b & mask].load(std::memory_order_relaxed);
+			if (t == b)
+			{
+				//the last item is contended by the thieves
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					node = nullptr;
+				}
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return node;
+		}
+
+		//any thread, takes up to half of the items (at most max_count) from the top and returns them linked in FIFO order
+		NodeType* steal_half(uint32_t max_count)
+		{
+			NodeType* head = nullptr;
+			NodeType* tail = nullptr;
+			uint32_t count = 0;
+			uint32_t target = 1;
+			while (count < target)
+			{
+				int64_t t = top.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				const int64_t b = bottom.load(std::memory_order_acquire);
+				if (t >= b)
+					break;
+
+				if (count == 0)
+				{
+					target = uint32_t(min((b - t + 1) / 2, int64_t(max_count)));
+				}
+
+				NodeType* node = items[t & mask].load(std::memory_order_relaxed);
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					break; //lost against the owner or another thief, keep what we have
+
+				node->next = nullptr;
+				if (head != nullptr)
+				{
+					tail->next = node;
+				}
+				else
+				{
+					head = node;
+				}
+				tail = node;
+				count++;
+			}
+			return head;
+		}
+
+		bool empty() const
+		{
+			return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+		}
+	};
+}
\ No newline at end of file
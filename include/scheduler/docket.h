@@ -10,7 +10,11 @@
 //DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
 //WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
+#include <bit>
+#include <concepts>
+#include "deque.h"
 #include "stack.h"
+#include "stealorder.h"
 #include "common/random.h"
 
 namespace schobi
@@ -21,11 +25,14 @@ namespace schobi
 		struct alignas(64) CacheAlignedStack : ThreadsafeStack<NodeType> {};
 		CacheAlignedStack* stacks;
 		uint32_t		   stack_count;
+		const StealOrder&  steal_order;
 
 	public:
 		static constexpr uint32_t RandomIndex = ~0u;
+		//pop_all hands out whole stacks, the scheduler splits off the surplus
+		static constexpr bool HandsOutBatches = false;
 
-		Docket(uint32_t stack_count) : stack_count(stack_count)
+		Docket(uint32_t stack_count, const StealOrder& steal_order) : stack_count(stack_count), steal_order(steal_order)
 		{
 			stacks = new CacheAlignedStack[stack_count];
 		}
@@ -40,6 +47,26 @@ namespace schobi
 			return stack_count;
 		}
 
+		//the stacks are shared by everyone, there is no owner
+		void bind_owner(uint32_t)
+		{
+		}
+
+		bool empty() const
+		{
+			for (uint32_t i = 0; i < stack_count; i++)
+			{
+				if (!stacks[i].empty())
+					return false;
+			}
+			return true;
+		}
+
+		bool empty(uint32_t index) const
+		{
+			return stacks[index].empty();
+		}
+
 		void put_multiple_items(NodeType* head, NodeType* tail, uint32_t preferred_index = RandomIndex)
 		{
 			if (preferred_index >= stack_count)
@@ -61,15 +88,351 @@ namespace schobi
 			if (disable_work_stealing || nodes != nullptr)
 				return nodes;
 
-			for (uint32_t i = 0; i < stack_count; i++)
+			for (uint32_t i = 0; i < steal_order.get_victim_count(); i++)
 			{
-				int32_t mult = i & 0x1 ? -1 : 1;
-				int32_t index = mult * ((i / 2) + 1);
-				selected_index = (preferred_index + index) % stack_count;
+				selected_index = steal_order.get_victim(preferred_index, i);
 				if (NodeType* nodes = stacks[selected_index].pop_all())
 					return nodes;
 			}
 			return nullptr;
 		}
 	};
+
+	template<typename T>
+	concept PrioritizedIntrusiveConstraint = IntrusiveConstraint<T> && requires (const T& t)
+	{
+		{ t.get_priority() } -> std::convertible_to<int32_t>;
+	};
+
+	//per worker Chase-Lev deques, the owner pushes and pops hot work at the bottom contention-free,
+	//thieves take the colder half from the top. Other threads post into a per worker inbox which the owner drains.
+	//Every worker keeps one deque and inbox per priority band, the owner and the thieves always serve the highest band first.
+	template<PrioritizedIntrusiveConstraint NodeType>
+	class WorkStealingDocket
+	{
+	public:
+		static constexpr uint32_t RandomIndex = ~0u;
+		static constexpr bool HandsOutBatches = true;
+		static constexpr uint32_t MaxBatchSize = 6;
+		static constexpr uint32_t MaxStealSize = 64;
+		static constexpr uint32_t BandCount = 8;
+
+	private:
+		struct Band
+		{
+			WorkStealingDeque<NodeType, 256> deque;
+			ThreadsafeStack<NodeType> inbox;
+
+			bool empty() const
+			{
+				return deque.empty() && inbox.empty();
+			}
+		};
+
+		struct alignas(64) Worker
+		{
+			//one bit per band that may hold items, a set bit can be stale but a clear bit never hides items
+			std::atomic_uint32_t occupied{ 0 };
+			Band bands[BandCount];
+		};
+		Worker*  workers;
+		uint32_t worker_count;
+		const StealOrder& steal_order;
+
+		static inline thread_local Worker* owned = nullptr;
+
+	public:
+		WorkStealingDocket(uint32_t worker_count, const StealOrder& steal_order) : worker_count(worker_count), steal_order(steal_order)
+		{
+			workers = new Worker[worker_count];
+		}
+
+		~WorkStealingDocket()
+		{
+			delete[] workers;
+		}
+
+		uint32_t get_stack_count() const
+		{
+			return worker_count;
+		}
+
+		//must be called from the worker thread that owns the deques at index
+		void bind_owner(uint32_t index)
+		{
+			owned = &workers[index];
+		}
+
+		bool empty() const
+		{
+			for (uint32_t i = 0; i < worker_count; i++)
+			{
+				for (const Band& band : workers[i].bands)
+				{
+					if (!band.empty())
+						return false;
+				}
+			}
+			return true;
+		}
+
+		bool empty(uint32_t index) const
+		{
+			for (const Band& band : workers[index].bands)
+			{
+				if (!band.empty())
+					return false;
+			}
+			return true;
+		}
+
+		//log scale bands: 0 has its own band, every 8 bits of magnitude moves one band further away from it
+		static uint32_t get_band(int32_t priority)
+		{
+			constexpr uint32_t half = BandCount / 2;
+			if (priority >= 0)
+			{
+				return priority == 0 ? half : half + min((uint32_t(std::bit_width(uint32_t(priority))) + 7) / 8, half - 1);
+			}
+			uint32_t magnitude = uint32_t(-int64_t(priority));
+			return half - 1 - min((uint32_t(std::bit_width(magnitude)) - 1) / 8, half - 1);
+		}
+
+		void put_multiple_items(NodeType* head, NodeType* /*tail*/, uint32_t preferred_index = RandomIndex)
+		{
+			if (preferred_index >= worker_count)
+			{
+				preferred_index = Random::pcg32() % worker_count;
+			}
+
+			Worker& worker = workers[preferred_index];
+			const bool is_owner = &worker == owned;
+			//grouped by band so every band is marked occupied once, the owner keeps the order for its deques
+			NodeType* band_heads[BandCount] = {};
+			NodeType* band_tails[BandCount] = {};
+			while (NodeType* node = head)
+			{
+				head = node->next;
+				uint32_t band = get_band(node->get_priority());
+				if (is_owner)
+				{
+					node->next = nullptr;
+					if (band_tails[band] != nullptr)
+						band_tails[band]->next = node;
+					else
+						band_heads[band] = node;
+					band_tails[band] = node;
+				}
+				else
+				{
+					node->next = band_heads[band];
+					band_heads[band] = node;
+					if (band_tails[band] == nullptr)
+					{
+						band_tails[band] = node;
+					}
+				}
+			}
+
+			for (uint32_t band = 0; band < BandCount; band++)
+			{
+				if (band_heads[band] != nullptr)
+				{
+					if (is_owner)
+					{
+						push_to_deque(worker, band, band_heads[band], band_tails[band]);
+					}
+					else
+					{
+						worker.bands[band].inbox.push_many(band_heads[band], band_tails[band]);
+						mark_occupied(worker, band);
+					}
+				}
+			}
+		}
+
+		//returns at most MaxBatchSize items, surplus stolen items stay with the thief
+		NodeType* get_multiple_items(uint32_t& selected_index, uint32_t preferred_index = RandomIndex, bool disable_work_stealing = false)
+		{
+			if (preferred_index >= worker_count)
+			{
+				preferred_index = Random::pcg32() % worker_count;
+			}
+
+			selected_index = preferred_index;
+			Worker& preferred = workers[preferred_index];
+			if (&preferred == owned)
+			{
+				if (NodeType* nodes = pop_batch(preferred))
+					return nodes;
+			}
+			else if (NodeType* nodes = steal_highest_band(preferred))
+			{
+				return nodes;
+			}
+
+			if (disable_work_stealing)
+				return nullptr;
+
+			//pick the victim with the highest occupied band within the closest level that has any work, ties go to the closest neighbour
+			uint32_t victim_index = ~0u;
+			uint32_t victim_occupied = 0;
+			StealLevel victim_level = StealLevel::Count;
+			for (uint32_t i = 0; i < steal_order.get_victim_count(); i++)
+			{
+				StealLevel level = steal_order.get_victim_level(preferred_index, i);
+				if (victim_index != ~0u && level != victim_level)
+					break;
+
+				uint32_t candidate = steal_order.get_victim(preferred_index, i);
+				uint32_t occupied = workers[candidate].occupied.load(std::memory_order_relaxed);
+				if (std::bit_width(occupied) > std::bit_width(victim_occupied))
+				{
+					victim_index = candidate;
+					victim_occupied = occupied;
+					victim_level = level;
+				}
+			}
+
+			if (victim_index != ~0u)
+			{
+				selected_index = victim_index;
+				if (NodeType* nodes = steal_highest_band(workers[victim_index]))
+					return nodes;
+			}
+			return nullptr;
+		}
+
+	private:
+		static void mark_occupied(Worker& worker, uint32_t band)
+		{
+			const uint32_t bit = 1u << band;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!(worker.occupied.load(std::memory_order_relaxed) & bit))
+			{
+				worker.occupied.fetch_or(bit, std::memory_order_seq_cst);
+			}
+		}
+
+		static void refresh_occupied(Worker& worker, uint32_t band)
+		{
+			const uint32_t bit = 1u << band;
+			worker.occupied.fetch_and(~bit, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!worker.bands[band].empty())
+			{
+				worker.occupied.fetch_or(bit, std::memory_order_seq_cst);
+			}
+		}
+
+		static void push_to_deque(Worker& worker, uint32_t band, NodeType* head, NodeType* tail)
+		{
+			Band& target = worker.bands[band];
+			while (NodeType* node = head)
+			{
+				head = node->next;
+				node->next = nullptr;
+				if (!target.deque.push(node))
+				{
+					//ring is full, overflow into the inbox
+					node->next = head;
+					target.inbox.push_many(node, tail);
+					break;
+				}
+			}
+			mark_occupied(worker, band);
+		}
+
+		static NodeType* pop_batch(Worker& worker)
+		{
+			NodeType* head = nullptr;
+			NodeType* tail = nullptr;
+			uint32_t count = 0;
+			uint32_t occupied = worker.occupied.load(std::memory_order_relaxed);
+			while (occupied != 0 && count < MaxBatchSize)
+			{
+				const uint32_t band = std::bit_width(occupied) - 1;
+				occupied &= ~(1u << band);
+
+				Band& source = worker.bands[band];
+				if (!source.inbox.empty())
+				{
+					if (NodeType* posted = source.inbox.pop_all())
+					{
+						NodeType* reversed = reverse_node_links(posted);
+						push_to_deque(worker, band, reversed, get_last_node(reversed));
+					}
+				}
+
+				for (; count < MaxBatchSize; count++)
+				{
+					NodeType* node = source.deque.pop();
+					if (node == nullptr)
+						break;
+
+					if (head != nullptr)
+					{
+						tail->next = node;
+					}
+					else
+					{
+						head = node;
+					}
+					tail = node;
+				}
+
+				if (source.empty())
+				{
+					refresh_occupied(worker, band);
+				}
+			}
+			return head;
+		}
+
+		static NodeType* split_batch(NodeType* nodes, uint32_t band)
+		{
+			NodeType* last = nodes;
+			for (uint32_t i = 1; i < MaxBatchSize && last->next != nullptr; i++)
+			{
+				last = last->next;
+			}
+
+			if (NodeType* surplus = last->next)
+			{
+				last->next = nullptr;
+				if (owned != nullptr)
+				{
+					//stolen items come oldest first, so the oldest ends up closest to the top for the next thief
+					push_to_deque(*owned, band, surplus, get_last_node(surplus));
+				}
+				else
+				{
+					last->next = surplus;
+				}
+			}
+			return nodes;
+		}
+
+		static NodeType* steal_highest_band(Worker& worker)
+		{
+			uint32_t occupied = worker.occupied.load(std::memory_order_relaxed);
+			while (occupied != 0)
+			{
+				const uint32_t band = std::bit_width(occupied) - 1;
+				occupied &= ~(1u << band);
+
+				Band& source = worker.bands[band];
+				if (NodeType* stolen = source.deque.steal_half(MaxStealSize))
+					return split_batch(stolen, band);
+
+				if (!source.inbox.empty())
+				{
+					if (NodeType* posted = source.inbox.pop_all())
+						return split_batch(posted, band);
+				}
+				refresh_occupied(worker, band);
+			}
+			return nullptr;
+		}
+	};
 }
\ No newline at end of file
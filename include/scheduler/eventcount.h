@@ -0,0 +1,71 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include <atomic>
+#include "common/futex.h"
+#include "common/utility.h"
+
+namespace schobi
+{
+	//lets idle threads sleep on a futex until a producer signals new work.
+	//usage: key = prepare_wait(); recheck for work; then either cancel_wait() or commit_wait(key)
+	class EventCount
+	{
+		alignas(64) std::atomic_uint32_t epoch{ 0 };
+		alignas(64) std::atomic_uint32_t waiters{ 0 };
+
+	public:
+		[[nodiscard]]
+		uint32_t prepare_wait()
+		{
+			waiters.fetch_add(1, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			return epoch.load(std::memory_order_acquire);
+		}
+
+		void cancel_wait()
+		{
+			waiters.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		void commit_wait(uint32_t key)
+		{
+			if (epoch.load(std::memory_order_acquire) == key)
+			{
+				futex_wait(epoch, key);
+			}
+			waiters.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		//must be called after the work has been published, wakes at most count sleepers
+		void notify(uint32_t count)
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			uint32_t sleeping = waiters.load(std::memory_order_relaxed);
+			if (sleeping == 0 || count == 0)
+				return;
+
+			epoch.fetch_add(1, std::memory_order_release);
+			futex_wake(epoch, min(count, sleeping));
+		}
+
+		void notify_all()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (waiters.load(std::memory_order_relaxed) == 0)
+				return;
+
+			epoch.fetch_add(1, std::memory_order_release);
+			futex_wake_all(epoch);
+		}
+	};
+}
\ No newline at end of file
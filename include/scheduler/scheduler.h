@@ -11,43 +11,142 @@
 //WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 #include <atomic>
+#include <cstdint>
+#include "common/defines.h"
 
 namespace schobi
 {
+	//16 byte task header without a vtable, the only implementation is the coroutine promise which defines
+	//is_ready, execute and park. the state word packs the priority above the done, waiting and cancelled bits, so it doubles as futex
 	struct Scheduable
 	{
-		static constexpr int32_t MIN_PRIORITY = INT32_MIN + 1;
-		static constexpr int32_t MAX_PRIORITY = INT32_MAX - 1;
+		static constexpr uint32_t DoneFlag = 1u << 0;
+		static constexpr uint32_t WaitingFlag = 1u << 1;
+		static constexpr uint32_t CancelledFlag = 1u << 2;
+		static constexpr uint32_t PriorityShift = 3;
+		static constexpr uint32_t FlagMask = (1u << PriorityShift) - 1;
+		static constexpr int32_t MIN_PRIORITY = -(INT32_MAX >> PriorityShift);
+		static constexpr int32_t MAX_PRIORITY = INT32_MAX >> PriorityShift;
 
 		Scheduable(int32_t priority);
 		Scheduable(Scheduable&&) = delete;
 		Scheduable(const Scheduable&) = delete;
-		virtual ~Scheduable();
+		~Scheduable();
 
-		virtual bool is_ready() const = 0;
-		virtual Scheduable* execute() = 0;
+		bool is_ready() const;
+		Scheduable* execute();
+		//hands the scheduable over to whatever it is waiting on, which reschedules it once it is ready.
+		//returns false if the dependency cannot notify, the scheduable then has to be polled through is_ready
+		bool park();
 		Scheduable* next = nullptr;
 
-		inline int32_t get_priority() const { return priority.load(std::memory_order_relaxed); };
+		inline int32_t get_priority() const { return int32_t(state.load(std::memory_order_relaxed)) >> PriorityShift; };
 		void adjust_priority(int32_t adjustment);
 		void exponentially_adjust_priority_up();
 		void exponentially_adjust_priority_down();
 
+		//a cancelled scheduable that did not start yet is finished without running, otherwise it is up to the task to check
+		inline void cancel() { state.fetch_or(CancelledFlag, std::memory_order_relaxed); }
+		inline bool is_cancelled() const { return (state.load(std::memory_order_relaxed) & CancelledFlag) != 0; }
+
+	protected:
+		std::atomic_uint32_t state;
+
 	private:
-		std::atomic_int32_t priority = 0;
 		int32_t priority_adjustment = 1;
 	};
+	static_assert(sizeof(Scheduable) == 16, "the task header should stay compact");
+
+	enum class ReadyQueue : uint8_t
+	{
+		WorkStealingDeques,	//per worker Chase-Lev deques bucketed by priority band
+		SharedStacks,		//per worker pop_all stacks, priorities are only sorted locally
+
+		Default = SCHOBI_USE_WORK_STEALING_DEQUE ? WorkStealingDeques : SharedStacks,
+	};
+
+	enum class StealPolicy : uint8_t
+	{
+		Disabled,			//workers only ever run what was scheduled to them
+		Neighbours,			//closest worker indices first
+		Topology,			//pins workers to cpus, steals from cache siblings before the node before remote nodes
+
+		Default = Neighbours,
+	};
+
+	struct SchedulerConfig
+	{
+		uint32_t worker_count = 0;					//0 uses max(4, std::thread::hardware_concurrency())
+		uint32_t spin_rounds = 9;					//idle rounds spent spinning before a worker parks
+		ReadyQueue ready_queue = ReadyQueue::Default;
+		StealPolicy steal_policy = StealPolicy::Default;
+		const char* thread_name = "schobi";			//workers are named thread_name-index
+	};
 
-	struct Scheduler
+	//steals summed over all workers by distance between thief and victim.
+	//without StealPolicy::Topology the workers are not pinned and every steal counts as remote
+	struct StealStats
 	{
+		uint64_t shared_cache = 0;
+		uint64_t same_node = 0;
+		uint64_t remote = 0;
+	};
+
+	//counters of one worker or the sum over all of them. steals are always counted,
+	//everything else stays zero unless SCHOBI_ENABLE_TELEMETRY is set
+	struct WorkerStats
+	{
+		uint64_t executed = 0;			//tasks resumed
+		uint64_t spin_rounds = 0;		//idle rounds spent in _mm_pause loops
+		uint64_t pauses = 0;			//_mm_pause instructions issued during those rounds
+		uint64_t yields = 0;			//idle rounds yielded because only blocked work was left
+		uint64_t parks = 0;				//times the worker went to sleep
+		uint64_t failed_polls = 0;		//polled blocked items that were still not ready
+		StealStats steals;
+	};
+
+	struct SchedulerImpl;
+	class Scheduler
+	{
+	public:
+		explicit Scheduler(const SchedulerConfig& config = {});
+		Scheduler(Scheduler&&) = delete;
+		Scheduler(const Scheduler&) = delete;
+		~Scheduler();
+
+		//work scheduled before start() queues up until the workers are running
+		void start();
+		//lets every worker finish its current round and joins them, queued work stays queued.
+		//cannot be called from one of the scheduler's own workers, use exit() there
+		void stop();
+		bool is_running() const;
+
+		//the scheduler of the calling worker thread, the default instance for every other thread
+		static Scheduler& current();
+		//the scheduler that owns whatever the calling thread is parking right now. a dependency that reschedules its waiters
+		//later has to record this in subscribe, the thread calling it may not even be a worker
+		static Scheduler& parking();
+		//true on the worker threads of any scheduler
+		static bool is_worker_thread();
+		//created and started on first use, stopped at process exit
+		static Scheduler& get_default();
+
 		static void execute_immediately(Scheduable* items);
-		static void schedule_randomly(Scheduable* items);
-		static void schedule_locally(Scheduable* items);
-		static void schedule_evenly(Scheduable* items);
-
-		static uint32_t get_worker_count();
-		static void enable_fuzzing();
-		static void disable_fuzzing();
-		static void exit();
+		static void schedule_randomly(Scheduable* items, Scheduler& scheduler = current());
+		static void schedule_locally(Scheduable* items, Scheduler& scheduler = current());
+		static void schedule_evenly(Scheduable* items, Scheduler& scheduler = current());
+
+		static uint32_t get_worker_count(Scheduler& scheduler = current());
+		static void enable_fuzzing(Scheduler& scheduler = current());
+		static void disable_fuzzing(Scheduler& scheduler = current());
+		static StealStats get_steal_stats(Scheduler& scheduler = current());
+		//relaxed reads of counters that keep moving, the fields are not a consistent cut
+		static WorkerStats snapshot_stats(Scheduler& scheduler = current());
+		static WorkerStats snapshot_worker_stats(uint32_t worker_index, Scheduler& scheduler = current());
+		//asks the workers to exit without waiting for them
+		static void exit(Scheduler& scheduler = get_default());
+
+	private:
+		SchedulerImpl* impl;
 	};
 };
\ No newline at end of file
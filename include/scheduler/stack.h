@@ -65,6 +65,11 @@ namespace schobi
 		{
 			return top.exchange(nullptr, std::memory_order_acquire);
 		}
+
+		inline bool empty() const
+		{
+			return top.load(std::memory_order_relaxed) == nullptr;
+		}
 	};
 
 	template<IntrusiveConstraint NodeType>
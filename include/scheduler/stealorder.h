@@ -0,0 +1,126 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+#include <cstdint>
+#include "common/topology.h"
+#include "common/utility.h"
+
+namespace schobi
+{
+	enum class StealLevel : uint8_t
+	{
+		SharedCache,	//victim shares the last level cache with the thief
+		SameNode,		//victim sits on the same numa node
+		Remote,			//victim sits on another node or the placement is unknown
+		Count,
+	};
+
+	//per worker list of victims to steal from, ordered from the closest to the most distant
+	class StealOrder
+	{
+		uint32_t    worker_count;
+		uint32_t*   victims;	//worker_count - 1 entries per worker
+		StealLevel* levels;		//level of every victim entry
+		StealLevel* matrix;		//level between every thief and victim
+
+	public:
+		//alternates +1, -1, +2, -2, ... around each worker, every victim counts as remote
+		explicit StealOrder(uint32_t worker_count) : StealOrder(worker_count, nullptr, 0)
+		{
+		}
+
+		//worker i runs on cpus[i % cpu_count], victims sharing a cache come first, then the node, then everybody else
+		StealOrder(uint32_t worker_count, const CpuInfo* cpus, uint32_t cpu_count) : worker_count(worker_count)
+		{
+			const uint32_t victim_count = worker_count - 1;
+			victims = new uint32_t[worker_count * victim_count];
+			levels = new StealLevel[worker_count * victim_count];
+			matrix = new StealLevel[worker_count * worker_count];
+			bool* taken = new bool[worker_count];
+
+			for (uint32_t thief = 0; thief < worker_count; thief++)
+			{
+				for (uint32_t victim = 0; victim < worker_count; victim++)
+				{
+					matrix[thief * worker_count + victim] = get_distance(cpus, cpu_count, thief, victim);
+				}
+
+				//neighbours in alternating order, stable within each level
+				for (uint32_t victim = 0; victim < worker_count; victim++)
+				{
+					taken[victim] = victim == thief;
+				}
+				uint32_t count = 0;
+				for (uint8_t level = 0; level < uint8_t(StealLevel::Count); level++)
+				{
+					for (uint32_t i = 0; i < 2 * worker_count; i++)
+					{
+						int32_t mult = i & 0x1 ? -1 : 1;
+						int32_t index = mult * ((i / 2) + 1);
+						uint32_t victim = uint32_t((int64_t(thief) + index + int64_t(worker_count) * 2) % worker_count);
+						if (taken[victim] || get_level(thief, victim) != StealLevel(level))
+							continue;
+
+						taken[victim] = true;
+						victims[thief * victim_count + count] = victim;
+						levels[thief * victim_count + count] = StealLevel(level);
+						count++;
+					}
+				}
+				expects(count == victim_count, "steal order is missing victims");
+			}
+			delete[] taken;
+		}
+
+		StealOrder(const StealOrder&) = delete;
+
+		~StealOrder()
+		{
+			delete[] victims;
+			delete[] levels;
+			delete[] matrix;
+		}
+
+		uint32_t get_victim_count() const
+		{
+			return worker_count - 1;
+		}
+
+		uint32_t get_victim(uint32_t thief, uint32_t i) const
+		{
+			return victims[thief * (worker_count - 1) + i];
+		}
+
+		StealLevel get_victim_level(uint32_t thief, uint32_t i) const
+		{
+			return levels[thief * (worker_count - 1) + i];
+		}
+
+		StealLevel get_level(uint32_t thief, uint32_t victim) const
+		{
+			return matrix[thief * worker_count + victim];
+		}
+
+	private:
+		static StealLevel get_distance(const CpuInfo* cpus, uint32_t cpu_count, uint32_t thief, uint32_t victim)
+		{
+			if (cpu_count == 0)
+				return StealLevel::Remote;
+
+			const CpuInfo& a = cpus[thief % cpu_count];
+			const CpuInfo& b = cpus[victim % cpu_count];
+			if (a.node != b.node)
+				return StealLevel::Remote;
+			return a.cache == b.cache ? StealLevel::SharedCache : StealLevel::SameNode;
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,99 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include "benchmark/benchmark.h"
+#include "common/allocator.h"
+#include "common/utility.h"
+
+namespace schobi
+{
+	namespace benchmark
+	{
+		struct CrossThreadFreeLabel;
+		using BenchmarkAllocator = ThreadsafeLinearAllocator<CrossThreadFreeLabel, 2 * 1024 * 1024>;
+
+		static const uint32_t block_count = 1 << 20;
+		static const uint32_t block_size = 64;
+		static const uint32_t max_thread_count = 64;
+		static const uint32_t round_count = 5;
+
+		//the calling thread allocates, thread_count threads free with interleaved indices so every page is shared by all of them
+		template<bool Batched>
+		static double measure(void** blocks, uint32_t thread_count)
+		{
+			for (uint32_t i = 0; i < block_count; i++)
+			{
+				blocks[i] = BenchmarkAllocator::alloc(block_size, 16);
+			}
+
+			std::atomic_uint32_t ready = { 0 };
+			std::atomic_bool go = { false };
+			std::thread threads[max_thread_count];
+			for (uint32_t t = 0; t < thread_count; t++)
+			{
+				threads[t] = std::thread([&, t]()
+				{
+					ready.fetch_add(1, std::memory_order_relaxed);
+					while (!go.load(std::memory_order_acquire))
+					{
+						std::this_thread::yield();
+					}
+
+					for (uint32_t i = t; i < block_count; i += thread_count)
+					{
+						if constexpr (Batched)
+							BenchmarkAllocator::free(blocks[i], block_size);
+						else
+							BenchmarkAllocator::free_immediately(blocks[i], block_size);
+					}
+					BenchmarkAllocator::flush();
+				});
+			}
+
+			while (ready.load(std::memory_order_relaxed) != thread_count)
+			{
+				std::this_thread::yield();
+			}
+			auto start = std::chrono::steady_clock::now();
+			go.store(true, std::memory_order_release);
+			for (uint32_t t = 0; t < thread_count; t++)
+			{
+				threads[t].join();
+			}
+			auto end = std::chrono::steady_clock::now();
+			return std::chrono::duration<double, std::nano>(end - start).count() / block_count;
+		}
+
+		int cross_thread_free()
+		{
+			const uint32_t thread_count = std::clamp(std::thread::hardware_concurrency(), 2u, max_thread_count);
+			void** blocks = new void*[block_count];
+
+			double immediate = 1e300;
+			double batched = 1e300;
+			for (uint32_t round = 0; round < round_count; round++)
+			{
+				immediate = std::min(immediate, measure<false>(blocks, thread_count));
+				batched = std::min(batched, measure<true>(blocks, thread_count));
+			}
+			delete[] blocks;
+
+			std::printf("cross thread free of %u blocks by %u threads, best of %u rounds\n", block_count, thread_count, round_count);
+			std::printf("  immediate: %6.2f ns/free\n", immediate);
+			std::printf("  batched:   %6.2f ns/free\n", batched);
+			return 0;
+		}
+	}
+}
\ No newline at end of file
@@ -10,9 +10,12 @@
 //DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
 //WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <malloc.h>
+#include <algorithm>
+#include <bit>
 #include <sanitizer/asan_interface.h>
 #include "common/allocator.h"
 #include "common/utility.h"
+#include "common/virtualmemory.h"
 
 #if __has_feature(address_sanitizer) || defined(__SANITIZE_ADDRESS__)
 #define SCHOBI_ASAN_POISON_MEMORY_REGION(addr, size) __asan_poison_memory_region((addr), (size))
@@ -28,8 +31,110 @@ namespace schobi
 {
 	namespace detail
 	{
-		AllocationImpl::AllocationImpl(size_t page_size, GetFromCacheType get_from_cache) : get_from_cache(get_from_cache), header(new(_mm_malloc(page_size, page_size)) Header(page_size))
+		static std::atomic_size_t page_cache_limit = { 64 * 1024 * 1024 };
+		static std::atomic_size_t oversized_cache_limit = { 64 * 1024 * 1024 };
+
+		//oversized blocks are mapped at least huge page aligned and never unmapped, so the buckets can be tagged stacks like the page cache
+		static const size_t oversized_alignment = huge_page_size;
+		using OversizedBucket = AllocationImpl::HeaderStack<oversized_alignment>;
+		//four classes per power of two, a block wastes at most a fifth of its size
+		static OversizedBucket oversized_buckets[sizeof(size_t) * CHAR_BIT * 4];
+		static std::atomic_size_t oversized_resident_bytes = { 0 };
+
+		//the quarter steps are multiples of the small page size, oversized blocks are larger than the page of their allocator
+		static SCHOBI_FORCEINLINE size_t get_oversized_block_size(size_t size)
+		{
+			const uint32_t exponent = uint32_t(std::bit_width(size - 1)) - 1;
+			const size_t step = std::max(size_t(1) << (exponent - 2), small_page_size);
+			return (size + step - 1) & ~(step - 1);
+		}
+
+		static SCHOBI_FORCEINLINE uint32_t get_oversized_bucket(size_t block_size)
+		{
+			const uint32_t exponent = uint32_t(std::bit_width(block_size - 1)) - 1;
+			return exponent * 4 + uint32_t(block_size >> (exponent - 2)) - 5;
+		}
+
+		AllocationImpl::Header* AllocationImpl::map_page(size_t page_size)
+		{
+			//the mapping stays alive for the lifetime of the process, a stale cache reader may still look at its header
+			void* page = map_pages(page_size, page_size);
+			expects(page != nullptr, "out of memory");
+			return static_cast<Header*>(page);
+		}
+
+		static void trim_to_limit(AllocationImpl::Header* header, std::atomic_size_t& resident_bytes, size_t limit)
+		{
+			const size_t page_size = header->page_size;
+			const size_t resident = resident_bytes.fetch_add(page_size, std::memory_order_relaxed) + page_size;
+			if (resident > limit && decommit_pages(reinterpret_cast<char*>(header) + small_page_size, page_size - small_page_size))
+			{
+				header->trimmed = true;
+				resident_bytes.fetch_sub(page_size, std::memory_order_relaxed);
+			}
+		}
+
+		void AllocationImpl::trim(Header* header, std::atomic_size_t& resident_bytes)
+		{
+			trim_to_limit(header, resident_bytes, page_cache_limit.load(std::memory_order_relaxed));
+		}
+
+		void AllocationImpl::untrim(Header* header, std::atomic_size_t& resident_bytes)
+		{
+			if (header->trimmed)
+			{
+				commit_pages(reinterpret_cast<char*>(header) + small_page_size, header->page_size - small_page_size);
+				header->trimmed = false;
+			}
+			else
+			{
+				resident_bytes.fetch_sub(header->page_size, std::memory_order_relaxed);
+			}
+		}
+
+		AllocatorCounters::~AllocatorCounters()
+		{
+#if SCHOBI_ENABLE_ALLOCATOR_STATS
+			expects(live_allocations.load(std::memory_order_relaxed) == 0, "leaking %zu allocations of %zu bytes", live_allocations.load(std::memory_order_relaxed), live_bytes.load(std::memory_order_relaxed));
+#endif
+		}
+
+		void AllocatorCounters::record_alloc(size_t size)
+		{
+			live_allocations.fetch_add(1, std::memory_order_relaxed);
+			live_bytes.fetch_add(size, std::memory_order_relaxed);
+			const uint32_t bucket = uint32_t(std::bit_width(std::max(size, size_t(64)) - 1)) - 6;
+			size_histogram[std::min(bucket, AllocatorStats::SizeHistogramBuckets - 1)].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void AllocatorCounters::record_free(size_t size)
+		{
+			live_allocations.fetch_sub(1, std::memory_order_relaxed);
+			live_bytes.fetch_sub(size, std::memory_order_relaxed);
+		}
+
+		AllocatorStats AllocatorCounters::snapshot(size_t pages_cached) const
+		{
+			AllocatorStats stats;
+			stats.live_allocations = live_allocations.load(std::memory_order_relaxed);
+			stats.live_bytes = live_bytes.load(std::memory_order_relaxed);
+			stats.pages_in_use = pages_in_use.load(std::memory_order_relaxed);
+			stats.pages_cached = pages_cached;
+			stats.tail_waste_bytes = tail_waste_bytes.load(std::memory_order_relaxed);
+			stats.oversized_allocations = oversized_allocations.load(std::memory_order_relaxed);
+			for (uint32_t i = 0; i < AllocatorStats::SizeHistogramBuckets; i++)
+			{
+				stats.size_histogram[i] = size_histogram[i].load(std::memory_order_relaxed);
+			}
+			return stats;
+		}
+
+		AllocationImpl::AllocationImpl(size_t page_size, GetFromCacheType get_from_cache, ReturnToCacheType return_to_cache, AllocatorCounters& counters) : get_from_cache(get_from_cache), return_to_cache(return_to_cache), counters(counters)
 		{
+			Header* cached = get_from_cache();
+			header = new(cached != nullptr ? cached : map_page(page_size)) Header(page_size);
+			SCHOBI_ALLOCATOR_STATS_ADD(counters.pages_in_use, 1);
+
 			static_assert(std::is_trivially_destructible_v<Header>, "Header must be trivially destructible");
 			expects(header->refcount.is_lock_free(), "for performance the refcount should be lock free");
 			expects(uintptr_t(header) % page_size == 0, "allocator requested alignment failed");
@@ -42,10 +147,11 @@ namespace schobi
 			if (header->refcount.fetch_sub(refcount_adjustment, std::memory_order_acq_rel) == refcount_adjustment)
 			{
 				SCHOBI_ASAN_UNPOISON_MEMORY_REGION(header, header->page_size);
-				_mm_free(header);
-				return;
+				SCHOBI_ALLOCATOR_STATS_SUB(counters.pages_in_use, 1);
+				return_to_cache(header);
 			}
-			expects(false, "leaking %zd allocations", header->refcount.load());
+			//otherwise the last free, possibly still sitting in another thread's batch, releases the page.
+			//frees from other threads are expected here, real leaks are reported by the counters at exit
 		}
 
 		SCHOBI_FORCEINLINE void* AllocationImpl::alloc(size_t offset, size_t size)
@@ -63,6 +169,7 @@ namespace schobi
 		void AllocationImpl::finalize()
 		{
 			size_t page_size = header->page_size;
+			SCHOBI_ALLOCATOR_STATS_ADD(counters.tail_waste_bytes, page_size - std::min(header->suballocation_offset, page_size));
 			size_t refcount_adjustment = Header::refcount_max - header->suballocation_count;
 			if(header->refcount.fetch_sub(refcount_adjustment, std::memory_order_acq_rel) == refcount_adjustment)
 			{
@@ -74,10 +181,11 @@ namespace schobi
 				Header* cached = get_from_cache();
 				if(cached == nullptr)
 				{
-					cached = (Header*)_mm_malloc(page_size, page_size);
+					cached = map_page(page_size);
 				}
 				//allocate a new page
 				header = new(cached) Header(page_size);
+				SCHOBI_ALLOCATOR_STATS_ADD(counters.pages_in_use, 1);
 			}
 
 			expects(uintptr_t(header) % page_size == 0, "allocator requested alignment failed");
@@ -108,7 +216,8 @@ namespace schobi
 			const size_t single_alloc_size = single_alloc_offset + size;
 			if (single_alloc_size > page_size) //oversized allocation
 			{
-				Header* oversized_header = new(_mm_malloc(single_alloc_size, page_size)) Header(single_alloc_size);
+				Header* oversized_header = alloc_oversized(single_alloc_size, page_size);
+				SCHOBI_ALLOCATOR_STATS_ADD(header.counters.oversized_allocations, 1);
 				oversized_header->refcount.store(1, std::memory_order_relaxed);
 				return reinterpret_cast<char*>(oversized_header) + single_alloc_offset;
 			}
@@ -126,8 +235,69 @@ namespace schobi
 			}
 			else
 			{
-				_mm_free(header);
+				free_oversized(header);
 			}
 		}
+
+		AllocationImpl::Header* ThreadsafeLinearAllocatorImpl::alloc_oversized(size_t size, size_t alignment)
+		{
+			const size_t block_size = get_oversized_block_size(size);
+			OversizedBucket& bucket = oversized_buckets[get_oversized_bucket(block_size)];
+
+			Header* block = bucket.pop();
+			if (block != nullptr && uintptr_t(block) % alignment != 0)
+			{
+				//only allocators with pages above the huge page size can miss the alignment, the block stays for the others
+				bucket.push(block, block);
+				block = nullptr;
+			}
+
+			if (block != nullptr)
+			{
+				AllocationImpl::untrim(block, oversized_resident_bytes);
+			}
+			else
+			{
+				block = static_cast<Header*>(map_pages(block_size, std::max(alignment, oversized_alignment)));
+				expects(block != nullptr, "out of memory");
+			}
+			return new(block) Header(block_size);
+		}
+
+		void ThreadsafeLinearAllocatorImpl::free_oversized(Header* header)
+		{
+			//past the limit the block keeps only its header page resident
+			trim_to_limit(header, oversized_resident_bytes, oversized_cache_limit.load(std::memory_order_relaxed));
+			oversized_buckets[get_oversized_bucket(header->page_size)].push(header, header);
+		}
+	}
+
+	namespace detail
+	{
+		static thread_local PendingFrees* pending_frees = nullptr;
+
+		void register_pending_frees(PendingFrees* pending)
+		{
+			pending->next = pending_frees;
+			pending_frees = pending;
+		}
+	}
+
+	void flush_pending_frees()
+	{
+		for (detail::PendingFrees* pending = detail::pending_frees; pending; pending = pending->next)
+		{
+			pending->flush();
+		}
+	}
+
+	void set_page_cache_limit(size_t bytes)
+	{
+		detail::page_cache_limit.store(bytes, std::memory_order_relaxed);
+	}
+
+	void set_oversized_cache_limit(size_t bytes)
+	{
+		detail::oversized_cache_limit.store(bytes, std::memory_order_relaxed);
 	}
 }
\ No newline at end of file
@@ -0,0 +1,82 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <climits>
+#include "common/defines.h"
+#include "common/futex.h"
+
+#if SCHOBI_PLATFORM_WINDOWS
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+	#pragma comment(lib, "Synchronization.lib")
+#elif SCHOBI_PLATFORM_LINUX
+	#include <linux/futex.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+namespace schobi
+{
+	static_assert(sizeof(std::atomic_uint32_t) == sizeof(uint32_t), "futex word must be a plain 32 bit integer");
+
+#if SCHOBI_PLATFORM_WINDOWS
+	void futex_wait(std::atomic_uint32_t& word, uint32_t expected)
+	{
+		WaitOnAddress(&word, &expected, sizeof(expected), INFINITE);
+	}
+
+	void futex_wake(std::atomic_uint32_t& word, uint32_t count)
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			WakeByAddressSingle(&word);
+		}
+	}
+
+	void futex_wake_all(std::atomic_uint32_t& word)
+	{
+		WakeByAddressAll(&word);
+	}
+#elif SCHOBI_PLATFORM_LINUX
+	void futex_wait(std::atomic_uint32_t& word, uint32_t expected)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+	}
+
+	void futex_wake(std::atomic_uint32_t& word, uint32_t count)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, int(count > INT_MAX ? INT_MAX : count), nullptr, nullptr, 0);
+	}
+
+	void futex_wake_all(std::atomic_uint32_t& word)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+	}
+#else
+	void futex_wait(std::atomic_uint32_t& word, uint32_t expected)
+	{
+		word.wait(expected, std::memory_order_relaxed);
+	}
+
+	void futex_wake(std::atomic_uint32_t& word, uint32_t count)
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			word.notify_one();
+		}
+	}
+
+	void futex_wake_all(std::atomic_uint32_t& word)
+	{
+		word.notify_all();
+	}
+#endif
+}
\ No newline at end of file
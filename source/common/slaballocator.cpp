@@ -0,0 +1,362 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <atomic>
+#include <cstdint>
+#include <malloc.h>
+#include <mutex>
+#include <new>
+#include "common/allocator.h"
+#include "common/slaballocator.h"
+#include "common/utility.h"
+
+namespace schobi
+{
+	namespace detail
+	{
+		static const size_t slab_size = 64 * 1024;
+		static const uint32_t remote_batch_size = 32;
+
+		//16 byte steps up to 512, 128 byte steps up to max_size
+		static const uint32_t fine_class_count = 32;
+		static const uint32_t class_count = fine_class_count + (SlabAllocator::max_size - 512) / 128;
+
+		static SCHOBI_FORCEINLINE uint32_t get_size_class(size_t size)
+		{
+			if (size <= 512)
+				return size == 0 ? 0 : uint32_t((size + 15) / 16) - 1;
+			return fine_class_count - 1 + uint32_t((size - 512 + 127) / 128);
+		}
+
+		static SCHOBI_FORCEINLINE size_t get_class_size(uint32_t size_class)
+		{
+			if (size_class < fine_class_count)
+				return (size_class + 1) * 16;
+			return 512 + (size_class - (fine_class_count - 1)) * 128;
+		}
+
+		struct FreeBlock
+		{
+			FreeBlock* next;
+		};
+
+		struct ThreadCache;
+		//everything but owner and size_class is only touched by the owning thread
+		struct alignas(64) SlabHeader
+		{
+			ThreadCache* owner;
+			uint32_t size_class;
+			uint32_t live = 0;
+			FreeBlock* free = nullptr;		//lifo, the most recently freed block is the hottest
+			char* bump = nullptr;
+			char* bump_end = nullptr;
+			SlabHeader* previous = nullptr;	//links of the partial list
+			SlabHeader* next = nullptr;
+		};
+
+		//outlives its thread, caches of exited threads are adopted by new ones because their blocks may still be in use
+		struct ThreadCache
+		{
+			//blocks come from current until it is full, slabs that got blocks back wait on the partial list.
+			//a slab whose last block comes back is released, one of them stays as spare so a class does not thrash
+			struct SizeClass
+			{
+				SlabHeader* current = nullptr;
+				SlabHeader* partial = nullptr;
+				SlabHeader* spare = nullptr;
+			};
+			SizeClass classes[class_count];
+
+			alignas(64) std::atomic<FreeBlock*> remote_frees{ nullptr };
+			ThreadCache* abandoned_next = nullptr;
+		};
+
+		static std::mutex abandoned_mutex;
+		static ThreadCache* abandoned_caches = nullptr;
+
+		static void push_remote(ThreadCache* owner, FreeBlock* head, FreeBlock* tail)
+		{
+			FreeBlock* top = owner->remote_frees.load(std::memory_order_relaxed);
+			do
+			{
+				tail->next = top;
+			} while (!owner->remote_frees.compare_exchange_weak(top, head, std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		//apart from the local state, it has to be readable after the state got destroyed
+		static constinit thread_local bool retired = false;
+		static void flush_local_batch();
+
+		struct LocalState
+		{
+			ThreadCache* cache = nullptr;
+
+			//frees of blocks owned by another cache, handed over once the batch is full, the owner changes or the thread idles
+			ThreadCache* batch_owner = nullptr;
+			FreeBlock* batch_head = nullptr;
+			FreeBlock* batch_tail = nullptr;
+			uint32_t batch_count = 0;
+			PendingFrees pending;
+
+			~LocalState()
+			{
+				flush_batch();
+				retired = true;
+				if (cache != nullptr)
+				{
+					std::lock_guard<std::mutex> guard(abandoned_mutex);
+					cache->abandoned_next = abandoned_caches;
+					abandoned_caches = cache;
+					cache = nullptr;
+				}
+			}
+
+			//both a thread that batches frees and one that owns slabs have something to hand over when idle
+			void track_pending()
+			{
+				if (pending.flush == nullptr)
+				{
+					pending.flush = &flush_local_batch;
+					register_pending_frees(&pending);
+				}
+			}
+
+			void flush_batch()
+			{
+				if (batch_head != nullptr)
+				{
+					push_remote(batch_owner, batch_head, batch_tail);
+					batch_head = batch_tail = nullptr;
+					batch_count = 0;
+				}
+			}
+
+			ThreadCache* get_cache()
+			{
+				if (cache == nullptr)
+				{
+					//only happens once per thread, so the lock stays off the hot path
+					std::lock_guard<std::mutex> guard(abandoned_mutex);
+					if (abandoned_caches != nullptr)
+					{
+						cache = abandoned_caches;
+						abandoned_caches = cache->abandoned_next;
+						cache->abandoned_next = nullptr;
+					}
+					else
+					{
+						cache = new ThreadCache();
+					}
+					track_pending();
+				}
+				return cache;
+			}
+		};
+		static thread_local LocalState local;
+
+		static SCHOBI_FORCEINLINE SlabHeader* get_slab(void* pointer)
+		{
+			return reinterpret_cast<SlabHeader*>(uintptr_t(pointer) & ~uintptr_t(slab_size - 1));
+		}
+
+		static void reset_slab(SlabHeader* slab)
+		{
+			const size_t class_size = get_class_size(slab->size_class);
+			const size_t usable = slab_size - sizeof(SlabHeader);
+			slab->free = nullptr;
+			slab->bump = reinterpret_cast<char*>(slab) + sizeof(SlabHeader);
+			slab->bump_end = slab->bump + (usable / class_size) * class_size;
+		}
+
+		static SCHOBI_FORCEINLINE bool is_full(const SlabHeader* slab)
+		{
+			return slab->free == nullptr && slab->bump == slab->bump_end;
+		}
+
+		static void link_partial(ThreadCache::SizeClass& target, SlabHeader* slab)
+		{
+			slab->previous = nullptr;
+			slab->next = target.partial;
+			if (target.partial != nullptr)
+				target.partial->previous = slab;
+			target.partial = slab;
+		}
+
+		static void unlink_partial(ThreadCache::SizeClass& target, SlabHeader* slab)
+		{
+			if (slab->previous != nullptr)
+				slab->previous->next = slab->next;
+			else
+				target.partial = slab->next;
+			if (slab->next != nullptr)
+				slab->next->previous = slab->previous;
+		}
+
+		//only called by the owner, for its own frees and for the ones collected from other threads
+		static void free_to_slab(ThreadCache* cache, FreeBlock* block)
+		{
+			SlabHeader* slab = get_slab(block);
+			ThreadCache::SizeClass& target = cache->classes[slab->size_class];
+			const bool was_full = is_full(slab);
+			block->next = slab->free;
+			slab->free = block;
+			--slab->live;
+			if (slab == target.current)
+				return;
+
+			//a slab that is neither current nor full sits on the partial list
+			if (slab->live == 0)
+			{
+				if (!was_full)
+					unlink_partial(target, slab);
+
+				if (target.spare == nullptr)
+				{
+					reset_slab(slab);
+					target.spare = slab;
+				}
+				else
+				{
+					_mm_free(slab);
+				}
+			}
+			else if (was_full)
+			{
+				link_partial(target, slab);
+			}
+		}
+
+		static void collect_remote_frees(ThreadCache* cache)
+		{
+			FreeBlock* block = cache->remote_frees.exchange(nullptr, std::memory_order_acquire);
+			while (block != nullptr)
+			{
+				FreeBlock* next = block->next;
+				free_to_slab(cache, block);
+				block = next;
+			}
+		}
+
+		//an idle thread hands out its batch and takes back what others freed, so empty slabs do not stay pinned
+		void flush_local_batch()
+		{
+			LocalState& state = local;
+			state.flush_batch();
+			if (state.cache != nullptr && state.cache->remote_frees.load(std::memory_order_relaxed) != nullptr)
+			{
+				collect_remote_frees(state.cache);
+			}
+		}
+
+		//the full current slab is dropped from the class, it comes back through the partial list once a block of it is freed
+		static SlabHeader* next_slab(ThreadCache* cache, uint32_t size_class)
+		{
+			ThreadCache::SizeClass& target = cache->classes[size_class];
+			SlabHeader* slab = target.partial;
+			if (slab != nullptr)
+			{
+				unlink_partial(target, slab);
+			}
+			else if (target.spare != nullptr)
+			{
+				slab = target.spare;
+				target.spare = nullptr;
+			}
+			else
+			{
+				void* memory = _mm_malloc(slab_size, slab_size);
+				expects(memory != nullptr, "out of memory");
+				slab = new(memory) SlabHeader{ cache, size_class };
+				reset_slab(slab);
+			}
+			target.current = slab;
+			return slab;
+		}
+	}
+
+	void* SlabAllocator::alloc(size_t size)
+	{
+		using namespace detail;
+		if (size > max_size)
+			return _mm_malloc(size, alignment);
+
+		ThreadCache* cache = local.get_cache();
+		const uint32_t size_class = get_size_class(size);
+		ThreadCache::SizeClass& target = cache->classes[size_class];
+		SlabHeader* slab = target.current;
+		if (slab == nullptr || is_full(slab))
+		{
+			if (cache->remote_frees.load(std::memory_order_relaxed) != nullptr)
+			{
+				collect_remote_frees(cache);
+			}
+
+			if (slab == nullptr || is_full(slab))
+			{
+				slab = next_slab(cache, size_class);
+			}
+		}
+
+		++slab->live;
+		if (FreeBlock* block = slab->free)
+		{
+			slab->free = block->next;
+			return block;
+		}
+
+		void* block = slab->bump;
+		slab->bump += get_class_size(size_class);
+		return block;
+	}
+
+	void SlabAllocator::free(void* pointer, size_t size)
+	{
+		using namespace detail;
+		if (size > max_size)
+		{
+			_mm_free(pointer);
+			return;
+		}
+
+		SlabHeader* slab = get_slab(pointer);
+		FreeBlock* block = new(pointer) FreeBlock{ nullptr };
+		if (retired)
+		{
+			push_remote(slab->owner, block, block);
+			return;
+		}
+
+		LocalState& state = local;
+		if (slab->owner == state.cache)
+		{
+			free_to_slab(state.cache, block);
+			return;
+		}
+
+		state.track_pending();
+		if (state.batch_owner != slab->owner)
+		{
+			state.flush_batch();
+			state.batch_owner = slab->owner;
+		}
+
+		if (state.batch_head == nullptr)
+		{
+			state.batch_tail = block;
+		}
+		block->next = state.batch_head;
+		state.batch_head = block;
+		if (++state.batch_count == remote_batch_size)
+		{
+			state.flush_batch();
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,226 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <algorithm>
+#include <malloc.h>
+#include <new>
+#include "common/taskarena.h"
+#include "common/utility.h"
+
+namespace schobi
+{
+	static const size_t initial_chunk_size = 64 * 1024;
+	static const size_t max_chunk_size = 2 * 1024 * 1024;
+	static const size_t window_size = 16 * 1024;
+	static const uint32_t window_cache_size = 4;
+
+	//ids are never reused, so a window left behind by a destroyed arena can not be mistaken for a new one at the same address
+	static std::atomic_uint64_t next_arena_id = { 1 };
+
+	struct Window
+	{
+		uint64_t arena_id = 0;
+		char* cursor = nullptr;
+		char* end = nullptr;
+	};
+
+	//a worker that hops between trees keeps one window per arena instead of dropping it on every switch
+	struct WindowCache
+	{
+		Window windows[window_cache_size];
+		uint32_t victim = 0;
+	};
+	static thread_local WindowCache window_cache;
+
+	//chained through previous, both in the current chain and on the retained stack
+	struct alignas(64) TaskArena::Chunk
+	{
+		std::atomic<Chunk*> previous;
+		size_t size;
+		std::atomic_size_t offset;
+	};
+
+	TaskArena* TaskArena::create(size_t limit)
+	{
+		return new TaskArena(limit);
+	}
+
+	void TaskArena::destroy(TaskArena* arena)
+	{
+#if SCHOBI_DEBUG
+		expects(arena->live_allocations.load(std::memory_order_relaxed) == 0, "task arena released with %zu live allocations", arena->live_allocations.load());
+#endif
+		delete arena;
+	}
+
+	TaskArena::TaskArena(size_t limit) : limit(limit), id(next_arena_id.fetch_add(1, std::memory_order_relaxed))
+	{
+	}
+
+	TaskArena::~TaskArena()
+	{
+		reset();
+		Chunk* chunk = retained.load(std::memory_order_relaxed);
+		while (chunk != nullptr)
+		{
+			Chunk* previous = chunk->previous.load(std::memory_order_relaxed);
+			_mm_free(chunk);
+			chunk = previous;
+		}
+	}
+
+	void TaskArena::reset()
+	{
+#if SCHOBI_DEBUG
+		expects(live_allocations.load(std::memory_order_relaxed) == 0, "task arena reset with %zu live allocations", live_allocations.load());
+#endif
+		//the whole current chain goes on top of the retained stack by relinking its oldest chunk
+		if (Chunk* newest = current.exchange(nullptr, std::memory_order_relaxed))
+		{
+			oldest->previous.store(retained.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			retained.store(newest, std::memory_order_relaxed);
+			oldest = nullptr;
+		}
+		exhausted.store(false, std::memory_order_relaxed);
+		//windows of the last round must not be bumped into anymore
+		id = next_arena_id.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void* TaskArena::alloc(size_t size)
+	{
+		const size_t aligned_size = (size + alignment - 1) & ~(alignment - 1);
+		char* memory;
+		Window* window = nullptr;
+		for (Window& cached : window_cache.windows)
+		{
+			if (cached.arena_id == id)
+			{
+				window = &cached;
+				break;
+			}
+		}
+
+		if (window != nullptr && size_t(window->end - window->cursor) >= aligned_size)
+		{
+			memory = window->cursor;
+			window->cursor += aligned_size;
+		}
+		else if (aligned_size > window_size / 4)
+		{
+			memory = alloc_shared(aligned_size);
+		}
+		else
+		{
+			//only the rest of a window of this arena is wasted, it is smaller than the frame. other arenas lose theirs round robin
+			memory = alloc_shared(window_size);
+			if (memory != nullptr)
+			{
+				if (window == nullptr)
+				{
+					window = &window_cache.windows[window_cache.victim];
+					window_cache.victim = (window_cache.victim + 1) % window_cache_size;
+				}
+				*window = { id, memory + aligned_size, memory + window_size };
+			}
+		}
+
+#if SCHOBI_DEBUG
+		if (memory != nullptr)
+			live_allocations.fetch_add(1, std::memory_order_relaxed);
+#endif
+		return memory;
+	}
+
+	char* TaskArena::alloc_shared(size_t size)
+	{
+		//past the limit every frame goes to the fallback, do not hammer the full chunk
+		if (exhausted.load(std::memory_order_relaxed))
+			return nullptr;
+
+		Chunk* chunk = current.load(std::memory_order_acquire);
+		while (true)
+		{
+			if (chunk != nullptr)
+			{
+				//a failed bump leaves the offset past the end, the chunk is full for everyone from then on
+				const size_t offset = chunk->offset.fetch_add(size, std::memory_order_relaxed);
+				if (offset + size <= chunk->size)
+					return reinterpret_cast<char*>(chunk) + offset;
+			}
+
+			chunk = grow(chunk, size);
+			if (chunk == nullptr)
+				return nullptr;
+		}
+	}
+
+	void TaskArena::free(void* pointer)
+	{
+		(void)pointer;
+#if SCHOBI_DEBUG
+		live_allocations.fetch_sub(1, std::memory_order_relaxed);
+#endif
+	}
+
+	TaskArena::Chunk* TaskArena::grow(Chunk* full, size_t needed)
+	{
+		Chunk* expected = full;
+		if (Chunk* chunk = take_retained(needed))
+		{
+			//a retained chunk cannot go back on the stack while others pop from it, so it is linked in even if somebody else grew first
+			do
+			{
+				chunk->previous.store(expected, std::memory_order_relaxed);
+			} while (!current.compare_exchange_weak(expected, chunk, std::memory_order_acq_rel, std::memory_order_acquire));
+
+			if (expected == nullptr)
+				oldest = chunk;
+			return chunk;
+		}
+
+		size_t size = full != nullptr ? std::min(full->size * 2, max_chunk_size) : initial_chunk_size;
+		size = std::max(size, sizeof(Chunk) + needed);
+		if (reserved_bytes.fetch_add(size, std::memory_order_relaxed) + size > limit)
+		{
+			reserved_bytes.fetch_sub(size, std::memory_order_relaxed);
+			exhausted.store(true, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		Chunk* chunk = new(_mm_malloc(size, alignof(Chunk))) Chunk{ { full }, size, { sizeof(Chunk) } };
+		if (current.compare_exchange_strong(expected, chunk, std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			if (full == nullptr)
+				oldest = chunk;
+			return chunk;
+		}
+
+		//somebody else grew the arena first, use theirs
+		reserved_bytes.fetch_sub(size, std::memory_order_relaxed);
+		_mm_free(chunk);
+		return expected;
+	}
+
+	TaskArena::Chunk* TaskArena::take_retained(size_t needed)
+	{
+		//nothing is pushed while chunks are popped, so the stack cannot suffer from aba. chunks that are too small stay for smaller requests
+		Chunk* head = retained.load(std::memory_order_acquire);
+		while (head != nullptr && head->size >= sizeof(Chunk) + needed)
+		{
+			if (retained.compare_exchange_weak(head, head->previous.load(std::memory_order_relaxed), std::memory_order_acquire, std::memory_order_acquire))
+			{
+				head->offset.store(sizeof(Chunk), std::memory_order_relaxed);
+				return head;
+			}
+		}
+		return nullptr;
+	}
+}
\ No newline at end of file
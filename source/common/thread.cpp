@@ -0,0 +1,59 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <cstring>
+#include "common/defines.h"
+#include "common/thread.h"
+
+#if SCHOBI_PLATFORM_WINDOWS
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#elif SCHOBI_PLATFORM_LINUX
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+namespace schobi
+{
+	void set_current_thread_name(const char* name)
+	{
+#if SCHOBI_PLATFORM_WINDOWS
+		wchar_t wide_name[64] = {};
+		MultiByteToWideChar(CP_UTF8, 0, name, -1, wide_name, int(sizeof(wide_name) / sizeof(wide_name[0])) - 1);
+		SetThreadDescription(GetCurrentThread(), wide_name);
+#elif SCHOBI_PLATFORM_LINUX
+		//linux limits thread names to 15 characters plus the terminator
+		char short_name[16] = {};
+		std::strncpy(short_name, name, sizeof(short_name) - 1);
+		pthread_setname_np(pthread_self(), short_name);
+#else
+		(void)name;
+#endif
+	}
+	bool pin_current_thread(uint32_t cpu)
+	{
+#if SCHOBI_PLATFORM_WINDOWS
+		if (cpu >= sizeof(DWORD_PTR) * 8)
+			return false;
+		return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#elif SCHOBI_PLATFORM_LINUX
+		if (cpu >= CPU_SETSIZE)
+			return false;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void)cpu;
+		return false;
+#endif
+	}
+}
\ No newline at end of file
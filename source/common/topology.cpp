@@ -0,0 +1,209 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include "common/defines.h"
+#include "common/topology.h"
+
+#if SCHOBI_PLATFORM_WINDOWS
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+	#include <malloc.h>
+#elif SCHOBI_PLATFORM_LINUX
+	#include <dirent.h>
+	#include <sched.h>
+#endif
+
+namespace schobi
+{
+	[[maybe_unused]] static void sort_cpus(CpuInfo* cpus, uint32_t count)
+	{
+		//rank hardware threads within their core so the first thread of every core is handed out first
+		uint32_t ranks[MaxCpuCount] = {};
+		for (uint32_t i = 0; i < count; i++)
+		{
+			for (uint32_t j = 0; j < i; j++)
+			{
+				if (cpus[j].core == cpus[i].core && cpus[j].cache == cpus[i].cache && cpus[j].node == cpus[i].node)
+					ranks[i]++;
+			}
+		}
+
+		uint32_t order[MaxCpuCount];
+		for (uint32_t i = 0; i < count; i++)
+		{
+			order[i] = i;
+		}
+		std::sort(order, order + count, [&](uint32_t a, uint32_t b)
+		{
+			const CpuInfo& ca = cpus[a];
+			const CpuInfo& cb = cpus[b];
+			if (ca.node != cb.node) return ca.node < cb.node;
+			if (ca.cache != cb.cache) return ca.cache < cb.cache;
+			if (ranks[a] != ranks[b]) return ranks[a] < ranks[b];
+			return ca.cpu < cb.cpu;
+		});
+
+		CpuInfo sorted[MaxCpuCount];
+		for (uint32_t i = 0; i < count; i++)
+		{
+			sorted[i] = cpus[order[i]];
+		}
+		std::copy(sorted, sorted + count, cpus);
+	}
+
+#if SCHOBI_PLATFORM_LINUX
+	//reads the first number of a sysfs value or cpu list like "0-7,64-71"
+	static bool read_first_number(const char* path, uint32_t& value)
+	{
+		FILE* file = std::fopen(path, "r");
+		if (file == nullptr)
+			return false;
+
+		bool found = std::fscanf(file, "%u", &value) == 1;
+		std::fclose(file);
+		return found;
+	}
+
+	static uint32_t get_last_level_cache(uint32_t cpu)
+	{
+		//the cache with the highest level wins, its lowest sharing cpu serves as the id
+		uint32_t best_level = 0;
+		uint32_t cache = cpu;
+		char path[128];
+		for (uint32_t index = 0; ; index++)
+		{
+			uint32_t level;
+			std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", cpu, index);
+			if (!read_first_number(path, level))
+				break;
+
+			uint32_t first_sharing;
+			std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list", cpu, index);
+			if (level > best_level && read_first_number(path, first_sharing))
+			{
+				best_level = level;
+				cache = first_sharing;
+			}
+		}
+		return cache;
+	}
+
+	static uint32_t get_node(uint32_t cpu)
+	{
+		char path[64];
+		std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+		uint32_t node = 0;
+		if (DIR* dir = opendir(path))
+		{
+			while (dirent* entry = readdir(dir))
+			{
+				if (std::sscanf(entry->d_name, "node%u", &node) == 1)
+					break;
+			}
+			closedir(dir);
+		}
+		return node;
+	}
+
+	uint32_t get_cpu_topology(CpuInfo* cpus, uint32_t capacity)
+	{
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			return 0;
+
+		capacity = std::min(capacity, uint32_t(MaxCpuCount));
+		uint32_t count = 0;
+		for (uint32_t cpu = 0; cpu < CPU_SETSIZE && count < capacity; cpu++)
+		{
+			if (!CPU_ISSET(cpu, &allowed))
+				continue;
+
+			char path[128];
+			std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+			uint32_t core = cpu;
+			read_first_number(path, core);
+			cpus[count++] = { cpu, core, get_last_level_cache(cpu), get_node(cpu) };
+		}
+		sort_cpus(cpus, count);
+		return count;
+	}
+#elif SCHOBI_PLATFORM_WINDOWS
+	//only processor group 0 is considered, pinning uses plain affinity masks
+	uint32_t get_cpu_topology(CpuInfo* cpus, uint32_t capacity)
+	{
+		DWORD length = 0;
+		GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+		if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+			return 0;
+
+		char* buffer = (char*)_malloca(length);
+		if (!GetLogicalProcessorInformationEx(RelationAll, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer, &length))
+		{
+			_freea(buffer);
+			return 0;
+		}
+
+		DWORD_PTR process_mask, system_mask;
+		GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask);
+
+		constexpr uint32_t MaxGroupCpus = sizeof(KAFFINITY) * 8;
+		CpuInfo all[MaxGroupCpus] = {};
+		uint32_t core_index = 0;
+		uint32_t best_cache_level[MaxGroupCpus] = {};
+		for (DWORD offset = 0; offset < length; )
+		{
+			auto* info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)(buffer + offset);
+			for (uint32_t cpu = 0; cpu < MaxGroupCpus; cpu++)
+			{
+				const KAFFINITY bit = KAFFINITY(1) << cpu;
+				if (info->Relationship == RelationProcessorCore && info->Processor.GroupMask[0].Group == 0 && (info->Processor.GroupMask[0].Mask & bit))
+				{
+					all[cpu].core = core_index;
+				}
+				else if (info->Relationship == RelationCache && info->Cache.GroupMask.Group == 0 && (info->Cache.GroupMask.Mask & bit) && info->Cache.Level > best_cache_level[cpu])
+				{
+					best_cache_level[cpu] = info->Cache.Level;
+					all[cpu].cache = uint32_t(std::countr_zero(uint64_t(info->Cache.GroupMask.Mask)));
+				}
+				else if (info->Relationship == RelationNumaNode && info->NumaNode.GroupMask.Group == 0 && (info->NumaNode.GroupMask.Mask & bit))
+				{
+					all[cpu].node = info->NumaNode.NodeNumber;
+				}
+			}
+			core_index += info->Relationship == RelationProcessorCore ? 1 : 0;
+			offset += info->Size;
+		}
+		_freea(buffer);
+
+		capacity = std::min(capacity, uint32_t(MaxCpuCount));
+		uint32_t count = 0;
+		for (uint32_t cpu = 0; cpu < MaxGroupCpus && count < capacity; cpu++)
+		{
+			if (process_mask & (DWORD_PTR(1) << cpu))
+			{
+				all[cpu].cpu = cpu;
+				cpus[count++] = all[cpu];
+			}
+		}
+		sort_cpus(cpus, count);
+		return count;
+	}
+#else
+	uint32_t get_cpu_topology(CpuInfo*, uint32_t)
+	{
+		return 0;
+	}
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <cstdint>
+#include "common/defines.h"
+#include "common/utility.h"
+#include "common/virtualmemory.h"
+
+#if SCHOBI_PLATFORM_WINDOWS
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#elif SCHOBI_PLATFORM_LINUX
+	#include <sys/mman.h>
+#else
+	#include <malloc.h>
+#endif
+
+namespace schobi
+{
+	static SCHOBI_FORCEINLINE uintptr_t align_up_pointer(uintptr_t pointer, size_t alignment)
+	{
+		return (pointer + alignment - 1) & ~uintptr_t(alignment - 1);
+	}
+
+#if SCHOBI_PLATFORM_LINUX
+	void* map_pages(size_t size, size_t alignment)
+	{
+		expects((alignment & (alignment - 1)) == 0 && size % small_page_size == 0, "invalid page mapping %zu %zu", size, alignment);
+		const bool huge = size % huge_page_size == 0;
+#ifdef MAP_HUGETLB
+		if (huge && alignment <= huge_page_size)
+		{
+			//explicit huge pages come aligned to their size but only exist if the admin reserved some
+			void* pointer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (pointer != MAP_FAILED)
+				return pointer;
+		}
+#endif
+		//over map and cut off the misaligned head and the tail
+		const size_t padding = alignment > small_page_size ? alignment : 0;
+		char* base = static_cast<char*>(mmap(nullptr, size + padding, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (base == MAP_FAILED)
+			return nullptr;
+
+		char* aligned = reinterpret_cast<char*>(align_up_pointer(uintptr_t(base), alignment));
+		if (aligned != base)
+		{
+			munmap(base, aligned - base);
+		}
+		if (char* tail = aligned + size; tail != base + size + padding)
+		{
+			munmap(tail, base + size + padding - tail);
+		}
+#ifdef MADV_HUGEPAGE
+		if (huge)
+		{
+			madvise(aligned, size, MADV_HUGEPAGE);
+		}
+#endif
+		return aligned;
+	}
+
+	bool decommit_pages(void* pointer, size_t size)
+	{
+		return madvise(pointer, size, MADV_DONTNEED) == 0;
+	}
+
+	void commit_pages(void*, size_t)
+	{
+		//the next touch faults zeroed pages back in
+	}
+#elif SCHOBI_PLATFORM_WINDOWS
+	void* map_pages(size_t size, size_t alignment)
+	{
+		expects((alignment & (alignment - 1)) == 0 && size % small_page_size == 0, "invalid page mapping %zu %zu", size, alignment);
+		const size_t large_page_minimum = GetLargePageMinimum();
+		if (large_page_minimum != 0 && size % large_page_minimum == 0 && alignment <= large_page_minimum)
+		{
+			//needs SeLockMemoryPrivilege, large pages are aligned to their size
+			if (void* pointer = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE))
+				return pointer;
+		}
+
+		//reserve a padded range to find an aligned address, then map exactly there. another thread may take it in between, so retry
+		for (uint32_t attempt = 0; attempt < 16; attempt++)
+		{
+			char* base = static_cast<char*>(VirtualAlloc(nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS));
+			if (base == nullptr)
+				return nullptr;
+
+			void* aligned = reinterpret_cast<void*>(align_up_pointer(uintptr_t(base), alignment));
+			VirtualFree(base, 0, MEM_RELEASE);
+			if (void* pointer = VirtualAlloc(aligned, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+				return pointer;
+		}
+		return nullptr;
+	}
+
+	bool decommit_pages(void* pointer, size_t size)
+	{
+		//large pages cannot be decommitted, VirtualFree fails for them
+		return VirtualFree(pointer, size, MEM_DECOMMIT) != 0;
+	}
+
+	void commit_pages(void* pointer, size_t size)
+	{
+		void* committed = VirtualAlloc(pointer, size, MEM_COMMIT, PAGE_READWRITE);
+		expects(committed != nullptr, "out of memory");
+	}
+#else
+	void* map_pages(size_t size, size_t alignment)
+	{
+		return _mm_malloc(size, alignment);
+	}
+
+	bool decommit_pages(void*, size_t)
+	{
+		return false;
+	}
+
+	void commit_pages(void*, size_t)
+	{
+	}
+#endif
+}
\ No newline at end of file
@@ -12,11 +12,170 @@
 
 #include "coroutine/awaitables.h"
 #include "common/utility.h"
+#include "scheduler/stack.h"
 
 namespace schobi
 {
 	ResourceLimiter::~ResourceLimiter()
 	{
-		expects(resource_limit.fetch_sub(limit, std::memory_order_relaxed) == limit, "leaking ResourceLimiter");
+		expects(available.load(std::memory_order_relaxed) == limit && queued.load(std::memory_order_relaxed) == 0, "leaking ResourceLimiter");
+	}
+
+	bool ResourceLimiter::take(int64_t cost)
+	{
+		//sequentially consistent, serve relies on it to see the cost a concurrent release gave back
+		int64_t current = available.load(std::memory_order_seq_cst);
+		while (current >= cost)
+		{
+			if (available.compare_exchange_weak(current, current - cost, std::memory_order_acquire, std::memory_order_relaxed))
+				return true;
+		}
+		return false;
+	}
+
+	bool ResourceLimiter::try_acquire(int64_t cost)
+	{
+		//queued waiters come first, jumping ahead of them would starve the large ones
+		return queued.load(std::memory_order_seq_cst) == 0 && take(cost);
+	}
+
+	bool ResourceLimiter::enqueue(ResourceLimitAwaitable* awaitable)
+	{
+		if (try_acquire(awaitable->cost))
+		{
+			awaitable->granted.store(true, std::memory_order_relaxed);
+			return false;
+		}
+
+		//counted before it is pushed, so a release either sees the waiter or the serve below sees its cost
+		queued.fetch_add(1, std::memory_order_seq_cst);
+		ResourceLimitAwaitable* top = incoming.load(std::memory_order_relaxed);
+		do
+		{
+			awaitable->next = top;
+		} while (!incoming.compare_exchange_weak(top, awaitable, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+		//from here on another thread may grant and resume the waiter, only serve can still tell whether it was us
+		return !serve(awaitable);
+	}
+
+	void ResourceLimiter::release(int64_t cost)
+	{
+		available.fetch_add(cost, std::memory_order_seq_cst);
+		if (queued.load(std::memory_order_seq_cst) != 0)
+		{
+			serve(nullptr);
+		}
+	}
+
+	bool ResourceLimiter::serve(const ResourceLimitAwaitable* self)
+	{
+		bool self_granted = false;
+		while (!serving.exchange(true, std::memory_order_seq_cst))
+		{
+			if (ResourceLimitAwaitable* arrived = incoming.exchange(nullptr, std::memory_order_acquire))
+			{
+				ResourceLimitAwaitable* arrived_tail = arrived;
+				arrived = reverse_node_links(arrived);
+				if (waiters_tail)
+					waiters_tail->next = arrived;
+				else
+					waiters_head = arrived;
+				waiters_tail = arrived_tail;
+			}
+
+			Scheduable* granted_head = nullptr;
+			Scheduable* granted_tail = nullptr;
+			Scheduler* granted_scheduler = nullptr;
+			while (ResourceLimitAwaitable* awaitable = waiters_head)
+			{
+				if (!take(awaitable->cost))
+					break;
+
+				waiters_head = awaitable->next;
+				if (waiters_head == nullptr)
+					waiters_tail = nullptr;
+				queued.fetch_sub(1, std::memory_order_relaxed);
+
+				if (awaitable == self)
+				{
+					self_granted = true;
+					awaitable->granted.store(true, std::memory_order_relaxed);
+					continue;
+				}
+
+				//the awaitable lives in the waiter's frame, which may run and go away as soon as it is scheduled
+				Scheduable* waiter = awaitable->waiter;
+				Scheduler* scheduler = awaitable->scheduler;
+				awaitable->granted.store(true, std::memory_order_release);
+				//waiters go back to the scheduler they parked on, runs of the same one are scheduled together
+				if (granted_head && scheduler != granted_scheduler)
+				{
+					Scheduler::schedule_locally(granted_head, *granted_scheduler);
+					granted_head = granted_tail = nullptr;
+				}
+				granted_scheduler = scheduler;
+				waiter->next = nullptr;
+				if (granted_tail)
+					granted_tail->next = waiter;
+				else
+					granted_head = waiter;
+				granted_tail = waiter;
+			}
+			const int64_t head_cost = waiters_head ? waiters_head->cost : -1;
+			serving.store(false, std::memory_order_seq_cst);
+
+			if (granted_head)
+			{
+				Scheduler::schedule_locally(granted_head, *granted_scheduler);
+			}
+
+			//a push or release that found us serving left its work to us, unless another thread took over by now
+			if (incoming.load(std::memory_order_seq_cst) == nullptr && (head_cost < 0 || available.load(std::memory_order_seq_cst) < head_cost))
+				break;
+		}
+		return self_granted;
+	}
+
+	AsyncMutex::~AsyncMutex()
+	{
+		expects(state.load(std::memory_order_relaxed) == Unlocked, "AsyncMutex destroyed while locked");
+	}
+
+	bool AsyncMutex::enqueue(LockAwaitable* awaitable) noexcept
+	{
+		LockAwaitable* current = state.load(std::memory_order_relaxed);
+		while (true)
+		{
+			if (current == Unlocked)
+			{
+				if (state.compare_exchange_weak(current, nullptr, std::memory_order_acquire, std::memory_order_relaxed))
+					return false;
+				continue;
+			}
+
+			awaitable->next = current;
+			if (state.compare_exchange_weak(current, awaitable, std::memory_order_release, std::memory_order_relaxed))
+				return true;
+		}
+	}
+
+	void AsyncMutex::unlock()
+	{
+		LockAwaitable* next_owner = waiting;
+		if (next_owner == nullptr)
+		{
+			LockAwaitable* expected = nullptr;
+			if (state.compare_exchange_strong(expected, Unlocked, std::memory_order_release, std::memory_order_relaxed))
+				return;
+
+			//take every new waiter at once and restore their arrival order, the mutex stays locked for the handoff
+			next_owner = reverse_node_links(state.exchange(nullptr, std::memory_order_acquire));
+		}
+		waiting = next_owner->next;
+		//the awaitable lives in the frame of the new owner, which may run and go away as soon as it is scheduled
+		Scheduable* waiter = next_owner->waiter;
+		Scheduler& scheduler = *next_owner->scheduler;
+		Scheduler::schedule_locally(waiter, scheduler);
 	}
 }
\ No newline at end of file
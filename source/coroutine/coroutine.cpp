@@ -11,9 +11,14 @@
 //WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <exception>
+#include <malloc.h>
+#include <new>
 #include <type_traits>
+#include <utility>
 #include "coroutine/coroutine.h"
 #include "common/allocator.h"
+#include "common/futex.h"
+#include "common/slaballocator.h"
 #include "common/utility.h"
 
 namespace schobi
@@ -21,29 +26,24 @@ namespace schobi
     namespace detail
     {
         thread_local SchedulingFlags scheduling_flags = SchedulingFlags::Inherited;
-        SetScopedSchedulingFlags::SetScopedSchedulingFlags(const ScheduablePromise& root) : old_flags(scheduling_flags)
-        {
-            scheduling_flags = root.flags;
-        }
-
-        SetScopedSchedulingFlags::~SetScopedSchedulingFlags()
-        {
-            scheduling_flags = old_flags;
-        }
 
         thread_local const ScheduablePromise* stack_root = nullptr;
+        thread_local TaskArena* current_arena = nullptr;
         SetScopedStackRoot::SetScopedStackRoot(const ScheduablePromise* root)
         {
             expects(stack_root == nullptr, "SchedulingFlags::Inherited on root is invalid");
             expects(root->flags != SchedulingFlags::Inherited, "SchedulingFlags::Inherited on root is invalid");
             stack_root = root;
             scheduling_flags = stack_root->flags;
+            outer_arena = current_arena;
+            current_arena = stack_root->arena;
         }
 
         SetScopedStackRoot::~SetScopedStackRoot()
         {
             stack_root->flags = scheduling_flags;
             stack_root = nullptr;
+            current_arena = outer_arena;
         }
 
         SetAwaitableAtRoot::SetAwaitableAtRoot(Awaitable* awaitable)
@@ -51,11 +51,37 @@ namespace schobi
             stack_root->set_dependency(awaitable);
         }
 
+        void SetActiveFrameAtRoot(std::coroutine_handle<> frame)
+        {
+            expects(stack_root != nullptr, "nested calls need a scheduled root");
+            stack_root->active = frame;
+        }
+
         SchedulingFlags GetSchedulingFlags()
         {
             return scheduling_flags;
         }
 
+        const CancellationSource* GetCurrentCancellation()
+        {
+            return stack_root ? stack_root->cancellation : nullptr;
+        }
+
+        bool IsCurrentTaskCancelled()
+        {
+            return stack_root && stack_root->is_cancelled();
+        }
+
+        TaskArena* GetCurrentArena()
+        {
+            return current_arena;
+        }
+
+        void SetCurrentArena(TaskArena* arena)
+        {
+            current_arena = arena;
+        }
+
         void Promise::unhandled_exception()
         { 
             expects(false, "something bad happened");
@@ -66,6 +92,10 @@ namespace schobi
         {
             expects(awaitable == nullptr, "Cannot have dependency!");
             awaitable = (Awaitable*)0x1;
+            if (owns_arena && arena)
+            {
+                TaskArena::destroy(arena);
+            }
         }
 
         void ScheduablePromise::set_dependency(Awaitable* in_awaitable) const
@@ -74,32 +104,60 @@ namespace schobi
             awaitable = in_awaitable;
         }
 
+        static Scheduable* const CompletedMarker = reinterpret_cast<Scheduable*>(0x1);
+
+        bool ScheduablePromise::park()
+        {
+            return awaitable && awaitable->subscribe(this);
+        }
+
         bool ScheduablePromise::is_ready() const
         {
-            if(!awaitable || awaitable->done())
-            {
-                awaitable = nullptr;
-                return true;
-            }
-            return false;
+            return !awaitable || awaitable->done();
         }
 
         [[nodiscard]]
         Scheduable* ScheduablePromise::execute()
         {
             expects(is_ready(), "Scheduable not ready!");
-            auto handle = handle_type::from_promise(*this);
-            expects(!handle.done(), "Coroutine done!");
-            
+            expects(!frame.done(), "Coroutine done!");
+            Awaitable* dependency = std::exchange(awaitable, nullptr);
+
+            //a cancelled task is not resumed again, it finishes without a result before its first resume or at the suspension point it
+            //parked on. the locals it holds there stay until the handle destroys the frame
+            const bool skipped = is_cancelled();
+            if (skipped)
             {
+                if (dependency)
+                    dependency->abandon();
+            }
+            else
+            {
+                started = true;
                 SetScopedStackRoot scope(this);
-                handle();
+                active.resume();
             }
 
-            if (handle.done())
+            if (skipped || frame.done())
             {
-                safely_done.count_down();
-                return nullptr;
+                //all frames of the tree are gone once the root is done, so the arena goes in one shot.
+                //the nested frames of a task skipped halfway still live in it, the destructor frees it with them
+                if (owns_arena && (frame.done() || !started))
+                {
+                    release_arena();
+                }
+
+                //the waiter becomes our continuation, nothing of this frame may be touched after it is marked done
+                Scheduable* continuation = waiter.exchange(CompletedMarker, std::memory_order_acq_rel);
+                mark_done();
+
+                //only the last child of a join continues with its waiter, the counter lives in the frame of that waiter
+                if (reinterpret_cast<uintptr_t>(continuation) & JoinTag)
+                {
+                    JoinCounter* join = reinterpret_cast<JoinCounter*>(reinterpret_cast<uintptr_t>(continuation) & ~JoinTag);
+                    return join->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 ? join->waiter : nullptr;
+                }
+                return continuation;
             }
             else
             {
@@ -107,35 +165,179 @@ namespace schobi
             }
         }
 
+        void ScheduablePromise::mark_done()
+        {
+            //the frame may already be gone when the wake is issued, waking a stale address is harmless
+            if (state.fetch_or(DoneFlag, std::memory_order_acq_rel) & WaitingFlag)
+            {
+                futex_wake_all(state);
+            }
+        }
+
+        void ScheduablePromise::wait()
+        {
+            uint32_t current = state.load(std::memory_order_acquire);
+            while (!(current & DoneFlag))
+            {
+                if (!(current & WaitingFlag))
+                {
+                    current = state.fetch_or(WaitingFlag, std::memory_order_acquire) | WaitingFlag;
+                    continue;
+                }
+                futex_wait(state, current);
+                current = state.load(std::memory_order_acquire);
+            }
+        }
+
+        void ScheduablePromise::release_arena()
+        {
+            arena_bytes = arena->get_reserved_bytes();
+            TaskArena::destroy(arena);
+            arena = nullptr;
+        }
+
         static const size_t LinearAllocatorPageSize = 2 * 1024 * 1024;
         using LinearAllocatorType = ThreadsafeLinearAllocator<Promise, LinearAllocatorPageSize>;
+
+        //every frame is prefixed with the backend that allocated it, so it can be freed from any thread or context
+        enum class FrameAllocator : uint8_t
+        {
+            Slab,
+            Linear,
+            Arena,
+            Batch,
+        };
+
+        struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) FrameTag
+        {
+            FrameAllocator allocator;
+            TaskArena* arena;
+        };
+        static_assert(SlabAllocator::alignment >= alignof(FrameTag), "frames need the default new alignment");
+        static_assert(TaskArena::alignment >= alignof(FrameTag), "frames need the default new alignment");
+
+        struct FrameBatch
+        {
+            static constexpr size_t slot_alignment = 64;
+
+            char* block = nullptr;
+            size_t frame_size = 0;
+            size_t stride = 0;
+            uint32_t count = 0;
+            uint32_t next = 0;
+            bool active = false;
+
+            void* alloc(size_t size)
+            {
+                if (block == nullptr)
+                {
+                    //the tag sits right before the frame, so the frame itself starts on a cache line
+                    frame_size = size;
+                    stride = (slot_alignment + size + slot_alignment - 1) & ~(slot_alignment - 1);
+                    block = static_cast<char*>(_mm_malloc(stride * count, slot_alignment));
+                    expects(block != nullptr, "out of memory");
+                }
+                expects(size == frame_size, "a frame batch only holds instances of the same coroutine");
+                expects(next < count, "frame batch overflow");
+
+                char* slot = block + stride * next++;
+                FrameTag* tag = new(slot + slot_alignment - sizeof(FrameTag)) FrameTag{ FrameAllocator::Batch, nullptr };
+                return tag + 1;
+            }
+        };
+        static thread_local FrameBatch frame_batch;
+
+        void BeginFrameBatch(uint32_t count)
+        {
+            expects(!frame_batch.active, "frame batches cannot be nested");
+            frame_batch = FrameBatch();
+            frame_batch.count = count;
+            frame_batch.active = true;
+        }
+
+        void* EndFrameBatch()
+        {
+            void* block = frame_batch.block;
+            frame_batch = FrameBatch();
+            return block;
+        }
+
+        void FreeFrameBatch(void* block)
+        {
+            _mm_free(block);
+        }
+
         void* coro_malloc(size_t size, SchedulingFlags flags)
         {
+            if (frame_batch.active)
+            {
+                return frame_batch.alloc(size);
+            }
+
             if (flags == SchedulingFlags::Inherited)
             {
                 expects(scheduling_flags != SchedulingFlags::Inherited, "SchedulingFlags::Inherited on root is invalid");
                 flags = scheduling_flags;
             }
-            if (flags == SchedulingFlags::ShortLived)
+
+            if (flags != SchedulingFlags::LongLived && current_arena != nullptr)
             {
-                return LinearAllocatorType::alloc(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+                if (void* memory = current_arena->alloc(sizeof(FrameTag) + size))
+                {
+                    return new(memory) FrameTag{ FrameAllocator::Arena, current_arena } + 1;
+                }
+            }
+
+            FrameTag* tag;
+            if (flags != SchedulingFlags::LongLived)
+            {
+                tag = new(LinearAllocatorType::alloc(sizeof(FrameTag) + size, alignof(FrameTag))) FrameTag{ FrameAllocator::Linear, nullptr };
             }
             else
             {
-                return _mm_malloc(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+                tag = new(SlabAllocator::alloc(sizeof(FrameTag) + size)) FrameTag{ FrameAllocator::Slab, nullptr };
             }
+            return tag + 1;
         }
 
-        void coro_free(void* pointer)
+        void coro_free(void* pointer, size_t size)
         {
-            if (scheduling_flags == SchedulingFlags::ShortLived)
+            FrameTag* tag = static_cast<FrameTag*>(pointer) - 1;
+            switch (tag->allocator)
             {
-                LinearAllocatorType::free(pointer);
-            }
-            else
-            {
-                _mm_free(pointer);
+            case FrameAllocator::Linear:
+                LinearAllocatorType::free(tag, sizeof(FrameTag) + size);
+                break;
+            case FrameAllocator::Slab:
+                SlabAllocator::free(tag, sizeof(FrameTag) + size);
+                break;
+            case FrameAllocator::Arena:
+                tag->arena->free(tag);
+                break;
+            case FrameAllocator::Batch:
+                //the whole block goes with FreeFrameBatch
+                break;
             }
         }
     }//namespace detail
+
+    bool Scheduable::is_ready() const
+    {
+        return static_cast<const detail::ScheduablePromise*>(this)->is_ready();
+    }
+
+    Scheduable* Scheduable::execute()
+    {
+        return static_cast<detail::ScheduablePromise*>(this)->execute();
+    }
+
+    bool Scheduable::park()
+    {
+        return static_cast<detail::ScheduablePromise*>(this)->park();
+    }
+
+    AllocatorStats get_frame_allocator_stats()
+    {
+        return detail::LinearAllocatorType::get_stats();
+    }
 }//namespace schobi
\ No newline at end of file
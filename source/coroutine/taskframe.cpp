@@ -0,0 +1,83 @@
+//Copyright 2023 Arne Schober
+//
+//Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met :
+//1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+//2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and /or other materials provided with the distribution.
+//3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+//
+//THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY 
+//AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL 
+//DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+//WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include <utility>
+#include "coroutine/taskframe.h"
+#include "common/utility.h"
+
+namespace schobi
+{
+    TaskFrame::TaskFrame(size_t arena_limit) : arena(TaskArena::create(arena_limit))
+    {
+    }
+
+    TaskFrame::~TaskFrame()
+    {
+        if (active)
+        {
+            end();
+        }
+        delete[] spawned;
+        TaskArena::destroy(arena);
+    }
+
+    void TaskFrame::begin()
+    {
+        expects(!active, "frame already began");
+        //end() blocks until the spawned tasks are done, which a worker must never do
+        expects(!Scheduler::is_worker_thread(), "frames cannot begin on a scheduler worker");
+        expects(detail::GetCurrentArena() == nullptr, "frames cannot be nested or begin inside a task");
+        detail::SetCurrentArena(arena);
+        active = true;
+    }
+
+    void TaskFrame::spawn(AsyncTask<>&& task, Scheduler& scheduler)
+    {
+        expects(active, "spawn outside of a frame");
+        if (spawned_count == spawned_capacity)
+        {
+            //the handles outlive the frame, so they are kept from frame to frame instead of living in the arena
+            spawned_capacity = max(16u, spawned_capacity * 2);
+            WaitHandle<>* grown = new WaitHandle<>[spawned_capacity];
+            for (uint32_t i = 0; i < spawned_count; i++)
+            {
+                grown[i] = std::move(spawned[i]);
+            }
+            delete[] spawned;
+            spawned = grown;
+        }
+        spawned[spawned_count++] = task.schedule(scheduler);
+    }
+
+    void TaskFrame::end()
+    {
+        expects(active, "end without begin");
+        for (uint32_t i = 0; i < spawned_count; i++)
+        {
+            spawned[i].wait();
+        }
+        //the frames are destroyed before the reset, their frees are no-ops
+        for (uint32_t i = 0; i < spawned_count; i++)
+        {
+            WaitHandle<> finished(std::move(spawned[i]));
+        }
+        spawned_count = 0;
+
+        detail::SetCurrentArena(nullptr);
+        arena->reset();
+        active = false;
+    }
+
+    size_t TaskFrame::get_reserved_bytes() const
+    {
+        return arena->get_reserved_bytes();
+    }
+}
\ No newline at end of file
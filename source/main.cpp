@@ -10,61 +10,65 @@
 //DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
 //WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <atomic>
 #include <chrono>
+#include <cstring>
 #include <thread>
 #include <optional>
+#include "benchmark/benchmark.h"
 #include "common/random.h"
 #include "common/utility.h"
 #include "coroutine/parallelfor.h"
+#include "coroutine/taskframe.h"
 #include "scheduler/scheduler.h"
 
-using Coroutine = schobi::Coroutine;
-using AsyncTask = schobi::AsyncTask;
+template<typename T = void>
+using Coroutine = schobi::Coroutine<T>;
+template<typename T = void>
+using AsyncTask = schobi::AsyncTask<T>;
 using AsyncTaskDesc = schobi::AsyncTaskDesc;
 using SchedulingFlags = schobi::SchedulingFlags;
 using Random = schobi::Random;
 using Scheduler = schobi::Scheduler;
 using ResourceLimiter = schobi::ResourceLimiter;
 
-AsyncTask fib_task(AsyncTaskDesc desc, volatile uint64_t& out, ResourceLimiter& limit, uint32_t depth, uint64_t n);
-inline Coroutine fib_coro(volatile uint64_t& out, ResourceLimiter& limit, uint32_t depth, uint64_t n)
+AsyncTask<uint64_t> fib_task(AsyncTaskDesc desc, ResourceLimiter& limit, uint32_t depth, uint64_t n);
+inline Coroutine<uint64_t> fib_coro(ResourceLimiter& limit, uint32_t depth, uint64_t n)
 {
     if (n <= 1)
     {
-        out = n;
-        co_return;
+        co_return n;
     }
 
-    uint64_t a = Random::pcg32();
-    uint64_t b = Random::pcg32();
+    uint64_t a;
+    uint64_t b;
     if (Random::pcg32() % 4 == 0)
     {
-        co_call(fib_coro(a, limit, depth + 1, n - 1));
-        co_call(fib_coro(b, limit, depth + 1, n - 2));
+        a = co_await fib_coro(limit, depth + 1, n - 1);
+        b = co_await fib_coro(limit, depth + 1, n - 2);
     }
     else if (Random::pcg32() % 4 == 0)
     {
         AsyncTaskDesc desc;
         desc.flags = SchedulingFlags::Inherited;
         desc.priority = depth;
-        co_call(fib_task(desc, a, limit, depth + 1, n - 1));
-        co_call(fib_task(desc, b, limit, depth + 1, n - 2));
+        a = co_await fib_task(desc, limit, depth + 1, n - 1);
+        b = co_await fib_task(desc, limit, depth + 1, n - 2);
     }
     else
     {
         AsyncTaskDesc desc;
         desc.flags = SchedulingFlags::ShortLived;
         desc.priority = depth;
-        auto ta = fib_task(desc, a, limit, depth + 1, n - 1).schedule();
-        co_await fib_task(desc, b, limit, depth + 1, n - 2).schedule();
-        co_await std::move(ta);
+        auto ta = fib_task(desc, limit, depth + 1, n - 1).schedule();
+        b = co_await fib_task(desc, limit, depth + 1, n - 2).schedule();
+        a = co_await std::move(ta);
     }
 
-    out = a + b;
-    co_return;
+    co_return a + b;
 }
 
-AsyncTask fib_task(AsyncTaskDesc desc, volatile uint64_t& out, ResourceLimiter& limit, uint32_t depth, uint64_t n)
+AsyncTask<uint64_t> fib_task(AsyncTaskDesc desc, ResourceLimiter& limit, uint32_t depth, uint64_t n)
 {
     auto limit_scope = limit.request();
     //const void* root_addr = schobi::detail::GetStackRootAddr();
@@ -72,42 +76,188 @@ AsyncTask fib_task(AsyncTaskDesc desc, volatile uint64_t& out, ResourceLimiter&
     using namespace std::chrono_literals;
     //std::this_thread::sleep_for(1ms);
     //expects(out == outc, "moep moep moep");
-    co_call(fib_coro(out, limit, depth, n));
+    co_return co_await fib_coro(limit, depth, n);
     //limit_scope.release();
 }
 
 template<uint32_t MaxWorkers>
-AsyncTask root_task(AsyncTaskDesc desc, volatile uint64_t& out, ResourceLimiter& limit, uint32_t depth, uint64_t n)
+AsyncTask<uint64_t> root_task(AsyncTaskDesc desc, ResourceLimiter& limit, uint32_t depth, uint64_t n)
 {
-    out = 0;
+    uint64_t out = 0;
     uint64_t outs[MaxWorkers];
-    auto pfor = [&outs, n, &limit, depth](uint32_t index) -> Coroutine
+    auto pfor = [&outs, n, &limit, depth](uint32_t index) -> Coroutine<>
     {
         auto limit_scope = co_await limit.request();
         expects(index < MaxWorkers, "buffer overflow");
-        co_call(fib_coro(outs[index], limit, depth, n));
+        outs[index] = co_await fib_coro(limit, depth, n);
         expects(outs[index] == 46368, "fib(24) == 46368");
         //limit_scope.release();
     };
-    co_call(schobi::parallel_for<MaxWorkers>(MaxWorkers, pfor));
+    co_await schobi::parallel_for<MaxWorkers>(MaxWorkers, pfor);
     for(uint32_t i = 0; i < MaxWorkers; i++)
     {
         expects(outs[i] == 46368, "fib(24) == 46368");
         out += outs[i];
     }
-    co_return;
+    co_return out;
 }
 
-int main()
+AsyncTask<uint64_t> square_task(AsyncTaskDesc desc, uint64_t n)
+{
+    co_return n * n;
+}
+
+AsyncTask<> frame_task(AsyncTaskDesc desc, uint64_t& out, uint64_t n)
+{
+    AsyncTaskDesc child_desc;
+    child_desc.flags = SchedulingFlags::Inherited;
+    schobi::WaitHandle<uint64_t> squares[4];
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        squares[i] = square_task(child_desc, n + i).schedule();
+    }
+    co_await schobi::AwaitAll<uint64_t>(squares);
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        out += squares[i].get();
+    }
+}
+
+//one worker keeps the windows per frame deterministic, so the arena has to get by with the chunks of the first frame
+void check_task_frames()
+{
+    schobi::SchedulerConfig config;
+    config.worker_count = 1;
+    config.thread_name = "frame";
+    Scheduler scheduler(config);
+    scheduler.start();
+
+    schobi::TaskFrame frame;
+    size_t reserved_bytes = 0;
+    for (uint32_t round = 0; round < 8; round++)
+    {
+        uint64_t outs[8] = {};
+        frame.begin();
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            AsyncTaskDesc desc;
+            desc.flags = SchedulingFlags::ShortLived;
+            frame.spawn(frame_task(desc, outs[i], i), scheduler);
+        }
+        frame.end();
+
+        for (uint64_t i = 0; i < 8; i++)
+        {
+            expects(outs[i] == i * i + (i + 1) * (i + 1) + (i + 2) * (i + 2) + (i + 3) * (i + 3), "frame %u lost a result", round);
+        }
+        if (round == 0)
+        {
+            reserved_bytes = frame.get_reserved_bytes();
+        }
+        expects(frame.get_reserved_bytes() == reserved_bytes, "frame %u grew the arena to %zu bytes", round, frame.get_reserved_bytes());
+    }
+}
+
+AsyncTask<> locked_increment(AsyncTaskDesc desc, schobi::AsyncMutex& mutex, uint64_t& counter)
+{
+    auto guard = co_await mutex.lock();
+    counter++;
+}
+
+void check_async_mutex()
+{
+    schobi::AsyncMutex mutex;
+    uint64_t counter = 0;
+    schobi::WaitHandle<> handles[256];
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        AsyncTaskDesc desc;
+        desc.flags = SchedulingFlags::ShortLived;
+        handles[i] = locked_increment(desc, mutex, counter).schedule();
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        handles[i].wait();
+    }
+    expects(counter == 256, "AsyncMutex lost %llu increments", 256 - (unsigned long long)counter);
+}
+
+AsyncTask<uint32_t> limited_task(AsyncTaskDesc desc, ResourceLimiter& limit, int64_t cost, std::atomic_uint32_t& tickets)
+{
+    auto limit_scope = co_await limit.request(cost);
+    co_return tickets.fetch_add(1, std::memory_order_relaxed);
+}
+
+//the large request queues up before the small ones, so it has to be granted first even though they would fit earlier
+void check_resource_limiter()
 {
-    //Scheduler::enable_fuzzing();
     ResourceLimiter limit(8);
-    uint64_t r = Random::pcg32();
+    expects(limit.try_acquire(8), "a fresh limiter has room for its limit");
+    expects(!limit.try_acquire(1), "an exhausted limiter cannot hand out more");
+
     AsyncTaskDesc desc;
     desc.flags = SchedulingFlags::ShortLived;
+    std::atomic_uint32_t tickets = { 0 };
+    auto large = limited_task(desc, limit, 8, tickets).schedule();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    schobi::WaitHandle<uint32_t> small[32];
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        small[i] = limited_task(desc, limit, 1, tickets).schedule();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    limit.release(8);
+
+    expects(large.get() == 0, "the large request was starved by small ones");
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        small[i].wait();
+    }
+    expects(limit.get_available() == 8, "the limiter ended with %lld instead of 8", (long long)limit.get_available());
+}
+
+//children inherit the cancellation source, the ones still queued when it fires finish without a result
+AsyncTask<uint64_t> cancellable_fib(AsyncTaskDesc desc, uint64_t n)
+{
+    if (n <= 1 || co_await schobi::cancellation_requested())
+    {
+        co_return n;
+    }
+
+    AsyncTaskDesc child_desc;
+    child_desc.flags = SchedulingFlags::Inherited;
+    auto a = cancellable_fib(child_desc, n - 1).schedule();
+    auto b = cancellable_fib(child_desc, n - 2).schedule();
+    co_await schobi::when_all(a, b);
+    co_return a.try_get().value_or(0) + b.try_get().value_or(0);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::strcmp(argv[1], "--benchmark-free") == 0)
+        return schobi::benchmark::cross_thread_free();
+
+    //Scheduler::enable_fuzzing();
+    ResourceLimiter limit(8);
+    AsyncTaskDesc desc;
+    desc.flags = SchedulingFlags::TaskArena;
     desc.priority = 0;
-    root_task<32>(desc, r, limit, 0, 24).schedule().wait();
+    uint64_t r = root_task<32>(desc, limit, 0, 24).schedule().get();
 
     expects(r == 32 * 46368, "fib(24) == 46368");
+
+    check_task_frames();
+    check_async_mutex();
+    check_resource_limiter();
+
+    schobi::CancellationSource cancellation;
+    AsyncTaskDesc cancel_desc;
+    cancel_desc.flags = SchedulingFlags::ShortLived;
+    cancel_desc.cancellation = &cancellation;
+    auto cancelled_tree = cancellable_fib(cancel_desc, 32).schedule();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    cancellation.cancel();
+    std::optional<uint64_t> partial = cancelled_tree.try_get();
+    expects(!partial || *partial < 2178309, "a cancelled fib(32) cannot be complete");
     Scheduler::exit();
 }
\ No newline at end of file
@@ -13,65 +13,215 @@
 #include <atomic>
 #include <immintrin.h>
 #include <xmmintrin.h>
+#include <cstdio>
 #include <thread>
+#include "common/allocator.h"
+#include "common/thread.h"
+#include "common/topology.h"
 #include "common/utility.h"
 #include "scheduler/docket.h"
+#include "scheduler/eventcount.h"
 #include "scheduler/scheduler.h"
 
+#if SCHOBI_ENABLE_TELEMETRY
+	#define SCHOBI_TELEMETRY_ADD(counter, amount) SchedulerImpl::add(counter, amount)
+#else
+	#define SCHOBI_TELEMETRY_ADD(counter, amount) (void)0
+#endif
+
 namespace schobi
 {
 	struct SchedulerImpl
 	{
 		static constexpr uint32_t RandomIndex = Docket<Scheduable>::RandomIndex;
+		const SchedulerConfig config;
+		const uint32_t worker_count;
+		Scheduler* const owner;
+		CpuInfo* const cpus;	//only queried for StealPolicy::Topology, the workers pin themselves from it
+		const uint32_t cpu_count;
+		const StealOrder steal_order;
 		std::thread* threads = nullptr;
-		Docket<Scheduable> ready_docket;
-		Docket<Scheduable> blocked_docket;
-		std::atomic_uint32_t disable_work_stealing{ 0 };
+		EventCount sleepers;
+		std::atomic_uint32_t disable_work_stealing;
 		std::atomic_bool done{ false };
 		std::atomic_bool fuzzing{ false };
-		
+
+		//written by the owning worker only, read by snapshot_stats
+		struct alignas(64) WorkerCounters
+		{
+			std::atomic_uint64_t steals[uint32_t(StealLevel::Count)];
+#if SCHOBI_ENABLE_TELEMETRY
+			std::atomic_uint64_t executed;
+			std::atomic_uint64_t spin_rounds;
+			std::atomic_uint64_t pauses;
+			std::atomic_uint64_t yields;
+			std::atomic_uint64_t parks;
+			std::atomic_uint64_t failed_polls;
+#endif
+		};
+		WorkerCounters* worker_counters;
+
 		static thread_local uint32_t preferred_index;
-		static SchedulerImpl self;
+		static thread_local SchedulerImpl* current;
+		//set while items of this scheduler are parked from a thread that is not one of its workers
+		static thread_local SchedulerImpl* parking;
+
+		SchedulerImpl(const SchedulerConfig& config, Scheduler* owner) : config(config), worker_count(get_thread_count(config)), owner(owner)
+			, cpus(config.steal_policy == StealPolicy::Topology ? new CpuInfo[MaxCpuCount] : nullptr), cpu_count(cpus ? get_cpu_topology(cpus, MaxCpuCount) : 0)
+			, steal_order(worker_count, cpus, cpu_count), disable_work_stealing(config.steal_policy == StealPolicy::Disabled ? 1 : 0)
+		{
+			worker_counters = new WorkerCounters[worker_count];
+		}
+
+		//derived classes stop the workers before their dockets go away
+		virtual ~SchedulerImpl()
+		{
+			delete[] worker_counters;
+			delete[] cpus;
+		}
 
-		SchedulerImpl() : ready_docket(get_thread_count()), blocked_docket(get_thread_count())
+		void start()
 		{
-			uint32_t thread_count = ready_docket.get_stack_count();
-			threads = new std::thread[thread_count];
-			for (uint32_t i = 0; i < thread_count; i++)
+			if (threads != nullptr)
+				return;
+
+			done.store(false, std::memory_order_relaxed);
+			threads = new std::thread[worker_count];
+			for (uint32_t i = 0; i < worker_count; i++)
 			{
-				threads[i] = std::thread([i]() mutable
+				threads[i] = std::thread([this, i]()
 				{
+					char name[64];
+					std::snprintf(name, sizeof(name), "%s-%u", config.thread_name ? config.thread_name : "schobi", i);
+					set_current_thread_name(name);
+					if (cpu_count != 0)
+					{
+						//consecutive workers land on cpus sharing a cache, see get_cpu_topology
+						pin_current_thread(cpus[i % cpu_count].cpu);
+					}
+
 					preferred_index = i;
+					current = this;
+					bind_worker(i);
 					scheduler_main();
+					current = nullptr;
+					preferred_index = RandomIndex;
 				});
 			}
 		}
 
-		~SchedulerImpl()
+		void request_exit()
+		{
+			done.store(true, std::memory_order_relaxed);
+			sleepers.notify_all();
+		}
+
+		void stop()
 		{
-			for (uint32_t i = 0; i < ready_docket.get_stack_count(); i++)
+			if (threads == nullptr)
+				return;
+
+			expects(current != this, "a scheduler cannot stop itself from one of its workers");
+			request_exit();
+			for (uint32_t i = 0; i < worker_count; i++)
 			{
 				threads[i].join();
 			}
 			delete[] threads;
+			threads = nullptr;
+		}
+
+		//the worker index of the calling thread if it belongs to this scheduler
+		uint32_t get_local_index() const
+		{
+			return current == this ? preferred_index : RandomIndex;
+		}
+
+		//single writer, so a plain store is enough and keeps the lock prefix off the hot path
+		static SCHOBI_FORCEINLINE void add(std::atomic_uint64_t& counter, uint64_t amount)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		}
+
+		//only ever called by the thief itself
+		void count_steal(uint32_t victim_index)
+		{
+			const uint32_t thief_index = preferred_index;
+			add(worker_counters[thief_index].steals[uint32_t(steal_order.get_level(thief_index, victim_index))], 1);
 		}
 
-		static SCHOBI_FORCEINLINE void schedule_items(Scheduable* items, uint32_t preferred_index);
+		WorkerStats snapshot_worker(uint32_t worker_index) const
+		{
+			const WorkerCounters& counters = worker_counters[worker_index];
+			WorkerStats stats;
+#if SCHOBI_ENABLE_TELEMETRY
+			stats.executed = counters.executed.load(std::memory_order_relaxed);
+			stats.spin_rounds = counters.spin_rounds.load(std::memory_order_relaxed);
+			stats.pauses = counters.pauses.load(std::memory_order_relaxed);
+			stats.yields = counters.yields.load(std::memory_order_relaxed);
+			stats.parks = counters.parks.load(std::memory_order_relaxed);
+			stats.failed_polls = counters.failed_polls.load(std::memory_order_relaxed);
+#endif
+			stats.steals.shared_cache = counters.steals[uint32_t(StealLevel::SharedCache)].load(std::memory_order_relaxed);
+			stats.steals.same_node = counters.steals[uint32_t(StealLevel::SameNode)].load(std::memory_order_relaxed);
+			stats.steals.remote = counters.steals[uint32_t(StealLevel::Remote)].load(std::memory_order_relaxed);
+			return stats;
+		}
+
+		virtual void schedule_items(Scheduable* items, uint32_t preferred_index) = 0;
+
+	protected:
+		virtual void bind_worker(uint32_t index) = 0;
+		virtual void scheduler_main() = 0;
 
 	private:
-		static uint32_t get_thread_count()
+		static uint32_t get_thread_count(const SchedulerConfig& config)
 		{
+			if (config.worker_count != 0)
+				return config.worker_count;
+
 			constexpr uint32_t min_thread_count = 4;
 			return std::max(min_thread_count, std::thread::hardware_concurrency());
 		}
-
-		static void scheduler_main();
 	};
 
 	thread_local uint32_t SchedulerImpl::preferred_index = SchedulerImpl::RandomIndex;
-	SchedulerImpl SchedulerImpl::self;
-	
-	Scheduable::Scheduable(int32_t priority) : priority(clamp(priority, MIN_PRIORITY, MAX_PRIORITY))
+	thread_local SchedulerImpl* SchedulerImpl::current = nullptr;
+	thread_local SchedulerImpl* SchedulerImpl::parking = nullptr;
+
+	template<typename ReadyDocket>
+	struct SchedulerImplT final : SchedulerImpl
+	{
+		ReadyDocket ready_docket;
+		Docket<Scheduable> blocked_docket;
+
+		SchedulerImplT(const SchedulerConfig& config, Scheduler* owner) : SchedulerImpl(config, owner), ready_docket(worker_count, steal_order), blocked_docket(worker_count, steal_order)
+		{
+		}
+
+		~SchedulerImplT()
+		{
+			stop();
+		}
+
+		void schedule_items(Scheduable* items, uint32_t preferred_index) override;
+
+	private:
+		void bind_worker(uint32_t index) override
+		{
+			ready_docket.bind_owner(index);
+			blocked_docket.bind_owner(index);
+		}
+
+		void scheduler_main() override;
+	};
+
+	static SCHOBI_FORCEINLINE uint32_t encode_priority(int32_t priority)
+	{
+		return uint32_t(priority) << Scheduable::PriorityShift;
+	}
+
+	Scheduable::Scheduable(int32_t priority) : state(encode_priority(clamp(priority, MIN_PRIORITY, MAX_PRIORITY)))
 	{};
 
 	Scheduable::~Scheduable()
@@ -81,15 +231,23 @@ namespace schobi
 
 	void Scheduable::adjust_priority(int32_t adjustment)
 	{
-		int32_t current_priority = priority.load(std::memory_order_relaxed);
-		if (adjustment < 0)
+		//the flag bits may change concurrently, so the priority bits are swapped in with a cas
+		uint32_t current_state = state.load(std::memory_order_relaxed);
+		uint32_t desired_state;
+		do
 		{
-			priority.store(current_priority > (MIN_PRIORITY - adjustment) ? current_priority + adjustment : MIN_PRIORITY, std::memory_order_relaxed);
-		}
-		else
-		{
-			priority.store(current_priority > (MAX_PRIORITY - adjustment) ? MAX_PRIORITY : current_priority + adjustment, std::memory_order_relaxed);
-		}
+			int32_t current_priority = int32_t(current_state) >> PriorityShift;
+			int32_t priority;
+			if (adjustment < 0)
+			{
+				priority = current_priority > (MIN_PRIORITY - adjustment) ? current_priority + adjustment : MIN_PRIORITY;
+			}
+			else
+			{
+				priority = current_priority > (MAX_PRIORITY - adjustment) ? MAX_PRIORITY : current_priority + adjustment;
+			}
+			desired_state = encode_priority(priority) | (current_state & FlagMask);
+		} while (!state.compare_exchange_weak(current_state, desired_state, std::memory_order_relaxed));
 	}
 
 	void Scheduable::exponentially_adjust_priority_up()
@@ -104,16 +262,22 @@ namespace schobi
 		adjust_priority(priority_adjustment);
 	}
 
-	static void test_blocked_or_ready(Scheduable*& blocked_head, Scheduable*& blocked_tail,
-									  Scheduable*& ready_head, Scheduable*& ready_tail,
-									  Scheduable* continuations)
+	static uint32_t test_blocked_or_ready(Scheduable*& blocked_head, Scheduable*& blocked_tail,
+										  Scheduable*& ready_head, Scheduable*& ready_tail,
+										  Scheduable* continuations)
 	{
+		uint32_t ready_count = 0;
 		while (Scheduable* continuation = continuations)
 		{
 			Scheduable* continuation_next = continuation->next;
 			continuation->next = nullptr;
 
-			if (continuation->is_ready())
+			const bool ready = continuation->is_ready();
+			if (!ready && continuation->park())
+			{
+				//the dependency reschedules it once done
+			}
+			else if (ready || continuation->is_ready())
 			{
 				if (ready_head != nullptr)
 				{
@@ -124,6 +288,7 @@ namespace schobi
 					ready_head = continuation;
 				}
 				ready_tail = continuation;
+				ready_count++;
 			}
 			else
 			{
@@ -139,75 +304,180 @@ namespace schobi
 			}
 			continuations = continuation_next;
 		}
+		return ready_count;
 	}
 
-	SCHOBI_FORCEINLINE void SchedulerImpl::schedule_items(Scheduable* items, uint32_t preferred_index)
+	template<typename ReadyDocket>
+	SCHOBI_FORCEINLINE void SchedulerImplT<ReadyDocket>::schedule_items(Scheduable* items, uint32_t preferred_index)
 	{
-		uint32_t disable_work_stealing = SchedulerImpl::self.disable_work_stealing.load(std::memory_order_relaxed);
-		if (!disable_work_stealing && SchedulerImpl::self.fuzzing.load(std::memory_order_relaxed))
+		uint32_t disable_work_stealing = this->disable_work_stealing.load(std::memory_order_relaxed);
+		if (!disable_work_stealing && fuzzing.load(std::memory_order_relaxed))
 		{
-			preferred_index = SchedulerImpl::RandomIndex;
+			preferred_index = RandomIndex;
 		}
 
 		Scheduable* blocked_head = nullptr; Scheduable* blocked_tail = nullptr;
 		Scheduable* ready_head = nullptr; Scheduable* ready_tail = nullptr;
-		test_blocked_or_ready(blocked_head, blocked_tail, ready_head, ready_tail, items);
+		SchedulerImpl* outer_parking = parking;
+		parking = this;
+		uint32_t ready_count = test_blocked_or_ready(blocked_head, blocked_tail, ready_head, ready_tail, items);
+		parking = outer_parking;
 
 		if (ready_head != nullptr)
 		{
-			self.ready_docket.put_multiple_items(ready_head, ready_tail, preferred_index);
+			ready_docket.put_multiple_items(ready_head, ready_tail, preferred_index);
+			if (disable_work_stealing)
+			{
+				//only the owning worker may pick the items up and we cannot tell which sleeper that is
+				sleepers.notify_all();
+			}
+			else
+			{
+				sleepers.notify(ready_count);
+			}
 		}
 		if (blocked_head != nullptr)
 		{
-			self.blocked_docket.put_multiple_items(blocked_head, blocked_tail, preferred_index);
+			blocked_docket.put_multiple_items(blocked_head, blocked_tail, preferred_index);
 		}
 	}
 
-	void Scheduler::schedule_randomly(Scheduable* items)
+	Scheduler::Scheduler(const SchedulerConfig& config)
 	{
-		SchedulerImpl::schedule_items(items, SchedulerImpl::RandomIndex);
+		if (config.ready_queue == ReadyQueue::WorkStealingDeques)
+		{
+			impl = new SchedulerImplT<WorkStealingDocket<Scheduable>>(config, this);
+		}
+		else
+		{
+			impl = new SchedulerImplT<Docket<Scheduable>>(config, this);
+		}
+	}
+
+	Scheduler::~Scheduler()
+	{
+		delete impl;
+	}
+
+	void Scheduler::start()
+	{
+		impl->start();
+	}
+
+	void Scheduler::stop()
+	{
+		impl->stop();
+	}
+
+	bool Scheduler::is_running() const
+	{
+		return impl->threads != nullptr && !impl->done.load(std::memory_order_relaxed);
+	}
+
+	Scheduler& Scheduler::current()
+	{
+		if (SchedulerImpl* current = SchedulerImpl::current)
+			return *current->owner;
+		return get_default();
 	}
 
-	void Scheduler::schedule_locally(Scheduable* items)
+	Scheduler& Scheduler::parking()
 	{
-		SchedulerImpl::schedule_items(items, SchedulerImpl::preferred_index);
+		if (SchedulerImpl* parking = SchedulerImpl::parking)
+			return *parking->owner;
+		return current();
 	}
 
-	void Scheduler::schedule_evenly(Scheduable* items)
+	bool Scheduler::is_worker_thread()
 	{
-		SchedulerImpl::self.disable_work_stealing.fetch_add(1, std::memory_order_acquire);
+		return SchedulerImpl::current != nullptr;
+	}
+
+	Scheduler& Scheduler::get_default()
+	{
+		static Scheduler instance;
+		static const bool started = (instance.start(), true);
+		(void)started;
+		return instance;
+	}
+
+	void Scheduler::schedule_randomly(Scheduable* items, Scheduler& scheduler)
+	{
+		scheduler.impl->schedule_items(items, SchedulerImpl::RandomIndex);
+	}
+
+	void Scheduler::schedule_locally(Scheduable* items, Scheduler& scheduler)
+	{
+		scheduler.impl->schedule_items(items, scheduler.impl->get_local_index());
+	}
+
+	void Scheduler::schedule_evenly(Scheduable* items, Scheduler& scheduler)
+	{
+		SchedulerImpl* impl = scheduler.impl;
+		impl->disable_work_stealing.fetch_add(1, std::memory_order_acquire);
 
 		uint32_t start_index = Random::pcg32();
-		uint32_t worker_count = SchedulerImpl::self.blocked_docket.get_stack_count();
+		uint32_t worker_count = impl->worker_count;
 		while (Scheduable* item = items)
 		{
 			Scheduable* next = item->next;
 			item->next = nullptr;
-			SchedulerImpl::schedule_items(item, ++start_index % worker_count);
+			impl->schedule_items(item, ++start_index % worker_count);
 			items = next;
 		}
 
-		SchedulerImpl::self.disable_work_stealing.fetch_sub(1, std::memory_order_release);
+		impl->disable_work_stealing.fetch_sub(1, std::memory_order_release);
 	}
 
-	uint32_t Scheduler::get_worker_count()
+	uint32_t Scheduler::get_worker_count(Scheduler& scheduler)
 	{
-		return SchedulerImpl::self.blocked_docket.get_stack_count();
+		return scheduler.impl->worker_count;
 	}
 
-	void Scheduler::enable_fuzzing()
+	void Scheduler::enable_fuzzing(Scheduler& scheduler)
 	{
-		SchedulerImpl::self.fuzzing.store(true, std::memory_order_relaxed);
+		scheduler.impl->fuzzing.store(true, std::memory_order_relaxed);
 	}
 
-	void Scheduler::disable_fuzzing()
+	void Scheduler::disable_fuzzing(Scheduler& scheduler)
 	{
-		SchedulerImpl::self.fuzzing.store(false, std::memory_order_relaxed);
+		scheduler.impl->fuzzing.store(false, std::memory_order_relaxed);
 	}
 
-	void Scheduler::exit()
+	StealStats Scheduler::get_steal_stats(Scheduler& scheduler)
 	{
-		SchedulerImpl::self.done.store(true, std::memory_order_relaxed);
+		return snapshot_stats(scheduler).steals;
+	}
+
+	WorkerStats Scheduler::snapshot_stats(Scheduler& scheduler)
+	{
+		SchedulerImpl* impl = scheduler.impl;
+		WorkerStats totals;
+		for (uint32_t i = 0; i < impl->worker_count; i++)
+		{
+			WorkerStats stats = impl->snapshot_worker(i);
+			totals.executed += stats.executed;
+			totals.spin_rounds += stats.spin_rounds;
+			totals.pauses += stats.pauses;
+			totals.yields += stats.yields;
+			totals.parks += stats.parks;
+			totals.failed_polls += stats.failed_polls;
+			totals.steals.shared_cache += stats.steals.shared_cache;
+			totals.steals.same_node += stats.steals.same_node;
+			totals.steals.remote += stats.steals.remote;
+		}
+		return totals;
+	}
+
+	WorkerStats Scheduler::snapshot_worker_stats(uint32_t worker_index, Scheduler& scheduler)
+	{
+		expects(worker_index < scheduler.impl->worker_count, "worker index %u out of range", worker_index);
+		return scheduler.impl->snapshot_worker(worker_index);
+	}
+
+	void Scheduler::exit(Scheduler& scheduler)
+	{
+		scheduler.impl->request_exit();
 	}
 
 	void Scheduler::execute_immediately(Scheduable* items)
@@ -270,80 +540,139 @@ namespace schobi
 		return { medianNode->next, get_last_node(processedNode) };
 	}
 
-	inline void SchedulerImpl::scheduler_main()
+	template<uint32_t N>
+	static SCHOBI_FORCEINLINE HeadAndTail take_and_sort(Scheduable* (&local)[N], Scheduable* processedNode)
+	{
+		uint32_t nodeCount = 0;
+		while (processedNode != nullptr && nodeCount < N)
+		{
+			local[nodeCount++] = processedNode;
+			processedNode = processedNode->next;
+		}
+		sortN(predicate, local);
+		return { processedNode, processedNode ? get_last_node(processedNode) : nullptr };
+	}
+
+	template<typename ReadyDocket>
+	void SchedulerImplT<ReadyDocket>::scheduler_main()
 	{
+		//adaptive spinning: grows when spinning found work, shrinks when the worker had to park anyway
+		const uint32_t max_spin_rounds = config.spin_rounds;
+		const uint32_t min_spin_rounds = min(2u, max_spin_rounds);
+		uint32_t spin_rounds = max_spin_rounds;
 		uint32_t loops_without_any_work = 0;
+		bool woken_up = false;
+		[[maybe_unused]] WorkerCounters& counters = worker_counters[SchedulerImpl::preferred_index];
 
-		while (!self.done.load(std::memory_order_relaxed))
+		while (!done.load(std::memory_order_relaxed))
 		{
 			uint32_t preferred_index = SchedulerImpl::preferred_index;
-			const bool enable_fuzzing = self.fuzzing.load(std::memory_order_relaxed);
-			const bool disable_work_stealing = !!self.disable_work_stealing.load(std::memory_order_acquire);
+			const bool enable_fuzzing = fuzzing.load(std::memory_order_relaxed);
+			const bool disable_work_stealing = !!this->disable_work_stealing.load(std::memory_order_acquire);
 			if (!disable_work_stealing && enable_fuzzing)
 			{
 				preferred_index = SchedulerImpl::RandomIndex;
 			}
 
 			uint32_t selected_index;
-			if (Scheduable* ready = self.ready_docket.get_multiple_items(selected_index, preferred_index, (loops_without_any_work < 2) || !!disable_work_stealing))
+			if (Scheduable* ready = ready_docket.get_multiple_items(selected_index, preferred_index, (loops_without_any_work < 2) || !!disable_work_stealing))
 			{
+				if (loops_without_any_work > 0 && !woken_up)
+				{
+					spin_rounds = min(spin_rounds * 2, max_spin_rounds);
+				}
 				loops_without_any_work = 0;
+				woken_up = false;
+				if (selected_index != SchedulerImpl::preferred_index)
+				{
+					count_steal(selected_index);
+				}
 
 				Scheduable* local[6] = {};
-				auto [median, median_tail] = take_sort_and_split(local, ready);
+				HeadAndTail split;
+				if constexpr (ReadyDocket::HandsOutBatches)
+				{
+					//stolen work stays with the thief
+					split = take_and_sort(local, ready);
+					selected_index = SchedulerImpl::preferred_index;
+				}
+				else
+				{
+					split = take_sort_and_split(local, ready);
+				}
+				auto [median, median_tail] = split;
 				if (median != nullptr && SchedulerImpl::preferred_index != selected_index)
 				{
-					self.ready_docket.put_multiple_items(median, median_tail, selected_index);
+					ready_docket.put_multiple_items(median, median_tail, selected_index);
 				}
 
 				Scheduable* blocked_head = nullptr; Scheduable* blocked_tail = nullptr;
 				Scheduable* ready_head = nullptr; Scheduable* ready_tail = nullptr;
-				for(uint32_t i = 0; i < array_size(local) && local[i] != nullptr; i++)
+				uint32_t ready_count = 0;
+				uint32_t executed_count = 0;
+				for(; executed_count < array_size(local) && local[executed_count] != nullptr; executed_count++)
 				{
-					local[i]->next = nullptr;
-					if (Scheduable* continuations = local[i]->execute())
+					local[executed_count]->next = nullptr;
+					if (Scheduable* continuations = local[executed_count]->execute())
 					{
-						test_blocked_or_ready(blocked_head, blocked_tail, ready_head, ready_tail, continuations);
+						ready_count += test_blocked_or_ready(blocked_head, blocked_tail, ready_head, ready_tail, continuations);
 					}
 				}
+				SCHOBI_TELEMETRY_ADD(counters.executed, executed_count);
 
 				if (ready_head != nullptr)
 				{
-					self.ready_docket.put_multiple_items(ready_head, ready_tail, preferred_index);
+					ready_docket.put_multiple_items(ready_head, ready_tail, preferred_index);
 				}
 				if (blocked_head != nullptr)
 				{
-					self.blocked_docket.put_multiple_items(blocked_head, blocked_tail, preferred_index);
+					blocked_docket.put_multiple_items(blocked_head, blocked_tail, preferred_index);
 				}
 
 				if (median != nullptr && SchedulerImpl::preferred_index == selected_index)
 				{
-					self.ready_docket.put_multiple_items(median, median_tail, SchedulerImpl::preferred_index);
+					ready_docket.put_multiple_items(median, median_tail, SchedulerImpl::preferred_index);
+				}
+
+				//this worker picks up one item itself, the rest may go to sleeping workers
+				uint32_t pending_count = ready_count + (median != nullptr ? 1 : 0);
+				if (pending_count > 1 && !disable_work_stealing)
+				{
+					sleepers.notify(pending_count - 1);
 				}
 			}
-			else if (Scheduable* blocked = self.blocked_docket.get_multiple_items(selected_index, (loops_without_any_work == 0) ? preferred_index : SchedulerImpl::RandomIndex, !!disable_work_stealing))
+			else if (Scheduable* blocked = blocked_docket.get_multiple_items(selected_index, (loops_without_any_work == 0 || disable_work_stealing) ? preferred_index : SchedulerImpl::RandomIndex, !!disable_work_stealing))
 			{
 				Scheduable* blocked_head = nullptr; Scheduable* blocked_tail = nullptr;
 				Scheduable* ready_head = nullptr; Scheduable* ready_tail = nullptr;
-				test_blocked_or_ready(blocked_head, blocked_tail, ready_head, ready_tail, blocked);
+				uint32_t ready_count = test_blocked_or_ready(blocked_head, blocked_tail, ready_head, ready_tail, blocked);
 
 				if (ready_head != nullptr)
 				{
 					loops_without_any_work = 0;
-					self.ready_docket.put_multiple_items(ready_head, ready_tail, preferred_index);
+					ready_docket.put_multiple_items(ready_head, ready_tail, preferred_index);
+					if (!disable_work_stealing)
+					{
+						sleepers.notify(ready_count - 1);
+					}
 				}
 				if (blocked_head != nullptr)
 				{
-					self.blocked_docket.put_multiple_items(blocked_head, blocked_tail, preferred_index);
+#if SCHOBI_ENABLE_TELEMETRY
+					size_t failed_count;
+					get_last_node_and_count(blocked_head, failed_count);
+					SCHOBI_TELEMETRY_ADD(counters.failed_polls, failed_count);
+#endif
+					blocked_docket.put_multiple_items(blocked_head, blocked_tail, preferred_index);
 				}
 			}
 			else
 			{
-				constexpr uint32_t yield_threshold = 9;
-				if (loops_without_any_work < yield_threshold)
+				if (loops_without_any_work < spin_rounds)
 				{
 					constexpr uint32_t wait_primes[8] = { 53, 97, 193, 389 };
-					for (uint32_t i = 0; i < wait_primes[Random::pcg32() % array_size(wait_primes)]; i++)
+					const uint32_t wait_loops = wait_primes[Random::pcg32() % array_size(wait_primes)];
+					for (uint32_t i = 0; i < wait_loops; i++)
 					{
 						_mm_pause();
 						_mm_pause();
@@ -354,11 +683,38 @@ namespace schobi
 						_mm_pause();
 					}
 					loops_without_any_work++;
+					SCHOBI_TELEMETRY_ADD(counters.spin_rounds, 1);
+					SCHOBI_TELEMETRY_ADD(counters.pauses, wait_loops * 7);
 				}
-				else
+				else if (disable_work_stealing ? !blocked_docket.empty(SchedulerImpl::preferred_index) : !blocked_docket.empty())
 				{
+					//blocked items still need to be polled, so stay awake
 					std::this_thread::yield();
 					loops_without_any_work = 0;
+					SCHOBI_TELEMETRY_ADD(counters.yields, 1);
+				}
+				else
+				{
+					spin_rounds = max(spin_rounds / 2, min_spin_rounds);
+					//frees batched by this worker would keep their memory alive for as long as it sleeps
+					flush_pending_frees();
+					uint32_t key = sleepers.prepare_wait();
+					//without work stealing only our own queues can keep us awake
+					const bool has_work = disable_work_stealing
+						? !ready_docket.empty(SchedulerImpl::preferred_index) || !blocked_docket.empty(SchedulerImpl::preferred_index)
+						: !ready_docket.empty() || !blocked_docket.empty();
+					if (done.load(std::memory_order_relaxed) || has_work)
+					{
+						sleepers.cancel_wait();
+					}
+					else
+					{
+						sleepers.commit_wait(key);
+						SCHOBI_TELEMETRY_ADD(counters.parks, 1);
+					}
+					//whoever woke us up most likely left work in another worker's queue
+					loops_without_any_work = min_spin_rounds;
+					woken_up = true;
 				}
 			}
 		}